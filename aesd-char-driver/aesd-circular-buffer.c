@@ -19,20 +19,8 @@
 
 size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer)
 {
-    size_t size = 0;
-    uint8_t index = buffer->out_offs;
-
-    // Well if the buffer is empty it's kinda easy!
-    if ( (false == buffer->full) && (buffer->in_offs == buffer->out_offs) ) {
-        return 0;
-    }
-
-    do {
-        size += buffer->entry[index++].size;
-    }
-    while( index < buffer->in_offs );
-
-    return size;
+    // kept up to date by the additions and evictions (needed by the byte budget anyway)
+    return buffer->total_size;
 }
 
 
@@ -48,29 +36,50 @@ size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer)
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer, size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    // If the buffer empty there is nothing to report
-    if ( (false == buffer->full) && (buffer->in_offs == buffer->out_offs) ) {
+    size_t base;
+    unsigned int low, high, middle;
+    struct aesd_buffer_entry *found;
+
+    // If the buffer empty (or not long enough) there is nothing to report
+    if (char_offset >= buffer->total_size) {
         return NULL;
     }
-    else {
 
-        uint8_t index = buffer->out_offs;
+    // Binary search of the newest entry starting at or before char_offset, the entry offsets growing from the oldest one
+    base = buffer->entry[buffer->out_offs].offset;
+    low = 0;
+    high = buffer->count - 1;
+    while (low < high) {
+        middle = low + (high - low + 1) / 2;
+        if (buffer->entry[(buffer->out_offs + middle) & buffer->mask].offset - base <= char_offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+
+    found = &buffer->entry[(buffer->out_offs + low) & buffer->mask];
+    *entry_offset_byte_rtn = char_offset - (found->offset - base);
+    return found;
+}
 
-        do {
-            if (char_offset < buffer->entry[index].size) {
-                *entry_offset_byte_rtn = char_offset;
-                return &buffer->entry[index];
-            }
+/**
+* Removes the oldest entry of @param buffer, which must not be empty, and clears its slot
+* @return the buffptr of the removed entry (for memory free usage)
+*/
+static const char * aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest = &buffer->entry[buffer->out_offs];
+    const char *erased_buffptr = oldest->buffptr;
 
-            char_offset -= buffer->entry[index].size;
+    buffer->total_size -= oldest->size;
+    oldest->buffptr = NULL;
+    oldest->size = 0;
 
-            if (++index == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-                index = 0;
-        }
-        while( index != (buffer->in_offs) );
-    }
+    buffer->out_offs = (buffer->out_offs + 1) & buffer->mask;
+    buffer->count--;
+    buffer->full = false;
 
-    return NULL;
+    return erased_buffptr;
 }
 
 /**
@@ -85,37 +94,67 @@ const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 {
     const char *erased_buffptr = NULL;
 
-    // If the buffer was already declared full (the Input table index reached back to Output position), the oldest position
-    // Output will be overwritten. Requiring to increment Output index to the following position (the futur new oldest), and also
-    // to return the pointer of the overwritten string in order to free its memory.
+    // If the buffer was already declared full (it holds max_entries entries), the oldest position Output is
+    // removed to make room. Its pointer is returned in order to free its memory.
     if (buffer->full == true) {
-        erased_buffptr = buffer->entry[buffer->out_offs].buffptr;
-        
-	// Next Output table index to point the new oldest
-        if (++buffer->out_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-            buffer->out_offs = 0;
+        erased_buffptr = aesd_circular_buffer_remove_oldest(buffer);
     }
 
     // Add a the entry at the indicated table Input index
     memcpy(&(buffer->entry[buffer->in_offs]), add_entry, sizeof(struct aesd_buffer_entry));
-    //buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
-    //buffer->entry[buffer->in_offs].size = add_entry->size;
-
-    // Set to the next Input table index
-    if (++buffer->in_offs == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
-        buffer->in_offs = 0;
-    
-    // If the next Input index folded back to the oldest Output position the buffer is declared full
-    if (buffer->in_offs == buffer->out_offs)
+    buffer->entry[buffer->in_offs].offset = buffer->total_added;
+    buffer->total_added += add_entry->size;
+    buffer->total_size += add_entry->size;
+    buffer->count++;
+
+    // Set to the next Input table index, the ring length being a power of 2 the mask wraps it around
+    buffer->in_offs = (buffer->in_offs + 1) & buffer->mask;
+
+    // If the capacity is reached the buffer is declared full
+    if (buffer->count == buffer->max_entries)
         buffer->full = true;
 
     return erased_buffptr;
 }
 
+/**
+* Evicts the oldest entry of @param buffer when it holds more bytes than its budget, the newest entry is always kept.
+* To be called after aesd_circular_buffer_add_entry() until it returns NULL.
+* Any necessary locking must be handled by the caller
+* @return NULL or the buffptr of the evicted entry (for memory free usage)
+*/
+const char * aesd_circular_buffer_evict(struct aesd_circular_buffer *buffer)
+{
+    if ((0 == buffer->max_bytes) || (buffer->total_size <= buffer->max_bytes) || (buffer->count <= 1)) {
+        return NULL;
+    }
+
+    return aesd_circular_buffer_remove_oldest(buffer);
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->mask = AESDCHAR_DEFAULT_RING_LEN - 1;
+    buffer->max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct using @param ring
+* @param ring an array of @param ring_len entries, a power of 2, allocated by the caller and zeroed
+* @param max_entries the entries kept at most, from 1 to ring_len
+* @param max_bytes the bytes kept at most, 0 for no budget
+*/
+void aesd_circular_buffer_init_ring(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *ring,
+        unsigned int ring_len, unsigned int max_entries, size_t max_bytes)
+{
+    memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = ring;
+    buffer->mask = ring_len - 1;
+    buffer->max_entries = max_entries;
+    buffer->max_bytes = max_bytes;
 }
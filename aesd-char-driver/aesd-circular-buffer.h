@@ -16,7 +16,8 @@
 #include <stdbool.h>
 #endif
 
-#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10    // default capacity, in entries
+#define AESDCHAR_DEFAULT_RING_LEN 16                  // ring used by aesd_circular_buffer_init(), a power of 2 above the default capacity
 
 struct aesd_buffer_entry
 {
@@ -28,27 +29,62 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Bytes added to the buffer before this entry since its initialization (set by aesd_circular_buffer_add_entry()),
+     * an entry starts at offset - the oldest entry offset in the concatenated content
+     */
+    size_t offset;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * The ring of the most recent write operations, a power of 2 long so indexes wrap with the mask.
+     * The slots not holding an entry have a NULL buffptr
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry *entry;
+    /**
+     * Ring length - 1
+     */
+    unsigned int mask;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    unsigned int in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    unsigned int out_offs;
+    /**
+     * Number of entries stored
+     */
+    unsigned int count;
+    /**
+     * Entries kept at most, the oldest one is overwritten beyond (at most the ring length)
+     */
+    unsigned int max_entries;
+    /**
+     * Total bytes stored
+     */
+    size_t total_size;
+    /**
+     * Total bytes added since the initialization, the offset of the next entry (wraps around harmlessly, only
+     * differences are used)
+     */
+    size_t total_added;
+    /**
+     * Bytes kept at most, the oldest entries are evicted beyond (0 for no budget)
+     */
+    size_t max_bytes;
     /**
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * The ring of aesd_circular_buffer_init()
+     */
+    struct aesd_buffer_entry default_entry[AESDCHAR_DEFAULT_RING_LEN];
 };
 
 extern size_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer);
@@ -58,16 +94,21 @@ extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos
 
 extern const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern const char * aesd_circular_buffer_evict(struct aesd_circular_buffer *buffer);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_init_ring(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *ring,
+            unsigned int ring_len, unsigned int max_entries, size_t max_bytes);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is an unsigned int stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * unsigned int index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -76,7 +117,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<=(buffer)->mask; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
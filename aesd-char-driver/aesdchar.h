@@ -25,14 +25,30 @@
 
 #include "aesd-circular-buffer.h"
 
+#define AESD_CHUNK_CACHED_LEN 256    // size of the chunks of the dedicated slab cache, most write commands fit
+
+/**
+ * The memory of an entry, its buffptr points to data. The readers copy from it without any lock while holding a
+ * reference, the ring holds one as well: the last one dropped frees it after an RCU grace period.
+ * Chunks up to AESD_CHUNK_CACHED_LEN come from the slab cache, the longer ones from kmalloc()
+ */
+struct aesd_chunk
+{
+    refcount_t ref;
+    struct rcu_head rcu;
+    size_t capacity;            // bytes data can hold
+    char data[];
+};
+
 struct aesd_dev
 {
     /**
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
-    struct aesd_buffer_entry buffer_entry;      // The buffer string will be dynamically allocated
+    struct aesd_buffer_entry buffer_entry;      // The buffer string will be dynamically allocated (data of a chunk)
     struct aesd_circular_buffer buffer_storage;  // Storage circular buffer
-    struct mutex lock;
+    struct mutex lock;                           // Serializes the writers, the readers don't take it
+    seqcount_mutex_t seq;                        // Readers retry their lookup when a writer changed the ring meanwhile
     struct cdev cdev;                            // Char device structure
 };
 
@@ -18,6 +18,13 @@
 #include <linux/types.h>
 #include <linux/cdev.h>
 #include <linux/fs.h>      // file_operations
+#include <linux/uio.h>     // iov_iter
+#include <linux/version.h>
+#include <linux/moduleparam.h>
+#include <linux/log2.h>    // roundup_pow_of_two()
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/seqlock.h>
 
 //#include <linux/uaccess.h> // userland memory
 
@@ -25,10 +32,28 @@
 #include "aesd_ioctl.h"
 
 #define DEVICE_NAME "aesdchar"
+#define AESD_MAX_ENTRIES_LIMIT (1U << 20)   // sanity bound of the max_entries parameter
+#define AESD_MAX_STREAMS 16                 // named instances beyond the default one
 
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+// Retention of the device, chosen at load time: aesdchar_load max_entries=1000 max_bytes=1048576
+static unsigned int max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(max_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(max_entries, "Write commands kept, the oldest one is dropped beyond (default 10)");
+
+static unsigned long max_bytes = 0;
+module_param(max_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(max_bytes, "Bytes kept, the oldest write commands are dropped beyond (default 0, no budget)");
+
+// Named instances, each with its own content and lock, on the minors following the default one:
+// aesdchar_load streams=alpha,beta creates /dev/aesdchar.alpha and /dev/aesdchar.beta (the aesdsocket streams)
+static char *streams[AESD_MAX_STREAMS];
+static int nr_streams = 0;
+module_param_array(streams, charp, &nr_streams, S_IRUGO);
+MODULE_PARM_DESC(streams, "Names of the extra instances, /dev/aesdchar.<name> from minor 1 (default none)");
+
 MODULE_AUTHOR("David Peter"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -58,51 +83,201 @@ int aesd_release(struct inode *inode, struct file *filp)
 
 
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+static struct kmem_cache *aesd_chunk_cache;   // chunks of AESD_CHUNK_CACHED_LEN bytes, the short writes don't go through kmalloc()
+
+#define AESD_CHUNK_CACHED_CAPACITY (AESD_CHUNK_CACHED_LEN - sizeof(struct aesd_chunk))
+
+static inline struct aesd_chunk *aesd_chunk_of(const char *buffptr)
 {
-    struct aesd_dev *aesd_device = filp->private_data;
-    struct aesd_buffer_entry *tmp_entry = NULL;
-    size_t entry_offset_byte = 0;
-    ssize_t retval = 0;
+    return container_of(buffptr, struct aesd_chunk, data[0]);
+}
 
-    PDEBUG("aesd_read %zu bytes with offset %lld (filp->f_po %lld)\n", count, *f_pos, filp->f_pos);
+static void aesd_chunk_free(struct aesd_chunk *chunk)
+{
+    // only the cached chunks have exactly that capacity, the kmalloc() ones are longer
+    if (AESD_CHUNK_CACHED_CAPACITY == chunk->capacity)
+        kmem_cache_free(aesd_chunk_cache, chunk);
+    else
+        kfree(chunk);
+}
 
-    /**
-     * TODO: handle read
-     */
-    if (mutex_lock_interruptible(&aesd_device->lock))
-        return -ERESTARTSYS;
+static void aesd_chunk_free_rcu(struct rcu_head *rcu)
+{
+    aesd_chunk_free(container_of(rcu, struct aesd_chunk, rcu));
+}
 
-    tmp_entry = aesd_circular_buffer_find_entry_offset_for_fpos(&aesd_device->buffer_storage, (size_t) *f_pos, &entry_offset_byte);
+/**
+ * Make room for needed bytes in the pending chunk, keeping its first size bytes. The chunk grows geometrically, so a
+ * command written in many parts isn't copied again for each of them
+ * @param chunk the pending chunk, NULL to allocate a new one
+ * @return the chunk with at least needed bytes of capacity (possibly moved), or NULL if out of memory (chunk is
+ *      left untouched)
+ */
+static struct aesd_chunk *aesd_chunk_reserve(struct aesd_chunk *chunk, size_t size, size_t needed)
+{
+    struct aesd_chunk *grown;
+    size_t capacity;
 
-    if(NULL == tmp_entry) {
-        //retval = EOF;
-	PDEBUG("aesd_read EOF\n");
-	retval = 0;
-	goto out;
+    if ((NULL != chunk) && (needed <= chunk->capacity))
+        return chunk;
+
+    if ((NULL == chunk) && (needed <= AESD_CHUNK_CACHED_CAPACITY)) {
+        grown = kmem_cache_alloc(aesd_chunk_cache, GFP_KERNEL);
+        if (NULL != grown)
+            grown->capacity = AESD_CHUNK_CACHED_CAPACITY;
+        return grown;
     }
 
-    PDEBUG("aesd_read temp_entry->buffptr %s ->size %ld with a desired entry_offset of %ld \n", tmp_entry->buffptr, tmp_entry->size, entry_offset_byte);
+    capacity = (NULL == chunk) ? needed : max(needed, 2 * chunk->capacity);
+    if ((NULL != chunk) && (AESD_CHUNK_CACHED_CAPACITY != chunk->capacity)) {
+        grown = krealloc(chunk, sizeof(struct aesd_chunk) + capacity, GFP_KERNEL);
+    }
+    else {
+        // a cached chunk moves to kmalloc()
+        grown = kmalloc(sizeof(struct aesd_chunk) + capacity, GFP_KERNEL);
+        if ((NULL != grown) && (NULL != chunk)) {
+            memcpy(grown->data, chunk->data, size);
+            kmem_cache_free(aesd_chunk_cache, chunk);
+        }
+    }
+
+    if (NULL != grown)
+        grown->capacity = capacity;
+    return grown;
+}
 
+/**
+ * Drop a reference on the chunk of an entry, the last one frees it once the readers looking it up are done
+ */
+static void aesd_chunk_put(const char *buffptr)
+{
+    struct aesd_chunk *chunk = aesd_chunk_of(buffptr);
 
-    // if the provided __user buf size count is bigger than the buffered string length we limit the read count at our storage string length
-    if (count > ( tmp_entry->size - entry_offset_byte )) {
-        count = ( tmp_entry->size - entry_offset_byte );
-        PDEBUG("aesd_read count clipped to %ld\n", count);
+    if (refcount_dec_and_test(&chunk->ref))
+        call_rcu(&chunk->rcu, aesd_chunk_free_rcu);
+}
+
+/**
+ * Look up the entry holding the position without any lock and take a reference on its chunk
+ * @param pos the position in the content, for the first entry of a read
+ * @param next set to the entry which follows the one returned, the following entries of a read are looked up with it
+ *      (unlike pos it doesn't move when the oldest entries are dropped meanwhile)
+ * @param entry_offset_byte set to the byte of the entry corresponding to the position
+ * @param avail set to the bytes of the entry from there
+ * @return the entry buffptr, to be released with aesd_chunk_put(), or NULL past the end of the content (or if the
+ *      next entry has been dropped already)
+ */
+static const char *aesd_chunk_get(struct aesd_dev *aesd_device, loff_t pos, bool first, size_t *next,
+        size_t *entry_offset_byte, size_t *avail)
+{
+    struct aesd_circular_buffer *buffer = &aesd_device->buffer_storage;
+    struct aesd_buffer_entry *tmp_entry;
+    const char *buffptr;
+    size_t lookup;
+    size_t size = 0;
+    size_t end = 0;
+    unsigned int seq;
+
+    rcu_read_lock();
+    do {
+        // a lookup racing with a writer may see a torn ring, it only stays in bounds and is done again
+        do {
+            seq = read_seqcount_begin(&aesd_device->seq);
+            buffptr = NULL;
+            // a dropped next entry is before the oldest one, the difference wraps past the content
+            lookup = first ? (size_t) pos : *next - buffer->entry[buffer->out_offs].offset;
+            tmp_entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, lookup, entry_offset_byte);
+            if (NULL != tmp_entry) {
+                buffptr = tmp_entry->buffptr;
+                size = tmp_entry->size;
+                end = tmp_entry->offset + size;
+            }
+        }
+        while (read_seqcount_retry(&aesd_device->seq, seq));
+        // evicted since, its chunk only waits for the grace period: the position now belongs to another entry
     }
+    while ((NULL != buffptr) && !refcount_inc_not_zero(&aesd_chunk_of(buffptr)->ref));
+    rcu_read_unlock();
 
-    PDEBUG("aesd_read string to send to user %s\n", tmp_entry->buffptr + entry_offset_byte);
-    if (copy_to_user(buf, tmp_entry->buffptr + entry_offset_byte, count)) {
-        retval = -EFAULT;
-        goto out;
+    if (NULL != buffptr) {
+        *avail = size - *entry_offset_byte;
+        *next = end;
     }
+    return buffptr;
+}
+
+
+
+/**
+ * The single reader path, for read() through aesd_read and for splice() feeding a pipe straight from the device
+ */
+ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct aesd_dev *aesd_device = iocb->ki_filp->private_data;
+    const char *buffptr;
+    size_t entry_offset_byte = 0;
+    size_t count = iov_iter_count(to);
+    size_t avail, chunk, copied;
+    size_t next = 0;
+    ssize_t retval = 0;
+
+    PDEBUG("aesd_read_iter %zu bytes with offset %lld\n", count, iocb->ki_pos);
+
+    // No lock: the readers run in parallel with each other and with the writers, each entry is looked up on its own
+    // and its memory held while copied (which may fault and sleep).
+    // The iterator is filled across the following entries as long as it has room: a whole replay takes a single call
+    while (count > 0) {
+        buffptr = aesd_chunk_get(aesd_device, iocb->ki_pos, 0 == retval, &next, &entry_offset_byte, &avail);
+        if (NULL == buffptr) {
+            PDEBUG("aesd_read_iter EOF\n");
+            break;
+        }
+
+        chunk = min(count, avail);
+        copied = copy_to_iter(buffptr + entry_offset_byte, chunk, to);
+        aesd_chunk_put(buffptr);
+
+        retval += copied;
+        count -= copied;
+        iocb->ki_pos += copied;
+        if (copied != chunk) {
+            if (0 == retval)
+                retval = -EFAULT;
+            break;
+        }
+    }
+
+    PDEBUG("aesd_read_iter retval %zd bytes with offset %lld\n", retval, iocb->ki_pos);
+    return retval;
+}
+
+
+
+ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = count };
+    struct iov_iter iter;
+    struct kiocb kiocb;
+    ssize_t retval;
+
+    PDEBUG("aesd_read %zu bytes with offset %lld (filp->f_po %lld)\n", count, *f_pos, filp->f_pos);
+
+    /**
+     * TODO: handle read
+     */
+    // the __user buf as an iterator, what aesd_read_iter() fills
+    init_sync_kiocb(&kiocb, filp);
+    kiocb.ki_pos = *f_pos;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
+    iov_iter_init(&iter, ITER_DEST, &iov, 1, count);
+#else
+    iov_iter_init(&iter, READ, &iov, 1, count);
+#endif
+
+    retval = aesd_read_iter(&kiocb, &iter);
+    *f_pos = kiocb.ki_pos;
 
-    *f_pos += count;
-    retval = count;
-        
-out:
     PDEBUG("aesd_read retval %zd bytes with offset %lld\n", retval, *f_pos);
-    mutex_unlock(&aesd_device->lock);
     return retval;
 }
 
@@ -111,11 +286,15 @@ out:
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
     struct aesd_dev *aesd_device = filp->private_data;
+    struct aesd_chunk *chunk = NULL;
     const char *tmp_buffptr = NULL;
     ssize_t retval = -ENOMEM;
 
     PDEBUG("aesd_write %zu bytes with offset %lld (filp->f_po %lld)\n", count, *f_pos, filp->f_pos);
 
+    if (0 == count)
+        return 0;
+
     /**
      * TODO: handle write
      */
@@ -124,26 +303,23 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff
     
     /* Either our buffer_entry is NULL because brand new or the previous data has been pushed to the circular storage, and a new allocation is required.
      * Either that entry isn't NULL because some data has already been stored but not pushed due to a lack of /n termination. In that case we 
-     * reallocate more memory to concatenate this new data coming from userland */
-    if (NULL == aesd_device->buffer_entry.buffptr) {
-	aesd_device->buffer_entry.size = 0;
-        aesd_device->buffer_entry.buffptr = kzalloc(count + 1, GFP_KERNEL); // Need an extra byte for \0 terminating the string
-        if (!aesd_device->buffer_entry.buffptr) {
-            retval = -ENOMEM;
-            goto end;
-        }
+     * reallocate more memory to concatenate this new data coming from userland. Nobody else sees the chunk until it's pushed */
+    if (NULL != aesd_device->buffer_entry.buffptr) {
+        chunk = aesd_chunk_of(aesd_device->buffer_entry.buffptr);
     }
     else {
-        tmp_buffptr = krealloc(aesd_device->buffer_entry.buffptr, aesd_device->buffer_entry.size + count, GFP_KERNEL);
-	aesd_device->buffer_entry.buffptr = tmp_buffptr;
-	if (!aesd_device->buffer_entry.buffptr) {
-            retval = -ENOMEM;
-            goto end;
-        }
+	aesd_device->buffer_entry.size = 0;
     }
+    chunk = aesd_chunk_reserve(chunk, aesd_device->buffer_entry.size, aesd_device->buffer_entry.size + count);
+    if (!chunk) {
+        // the data already pending is kept
+        retval = -ENOMEM;
+        goto end;
+    }
+    aesd_device->buffer_entry.buffptr = chunk->data;
 
     // retrieve userland data and concatenate that into buffer_entry
-    if (copy_from_user((void *)(aesd_device->buffer_entry.buffptr + aesd_device->buffer_entry.size), buf, count)) {
+    if (copy_from_user(chunk->data + aesd_device->buffer_entry.size, buf, count)) {
                 retval = -EFAULT;
                 goto fault;
     }
@@ -152,11 +328,24 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff
 
     // only if the buffer_entry terminates with /n the data is pushed and the buffer_entry reset to NULL
     if ('\n' == aesd_device->buffer_entry.buffptr[aesd_device->buffer_entry.size - 1]) {
+        // the ring reference
+        refcount_set(&chunk->ref, 1);
+
+        // published to the readers at once, the chunks dropped stay readable by the ones holding them
+        write_seqcount_begin(&aesd_device->seq);
+
 	tmp_buffptr = aesd_circular_buffer_add_entry(&aesd_device->buffer_storage, &aesd_device->buffer_entry);
         if (NULL != tmp_buffptr) {
-            kfree(tmp_buffptr);
+            aesd_chunk_put(tmp_buffptr);
         }
 
+        // then the byte budget may drop some more of the oldest ones
+        while (NULL != (tmp_buffptr = aesd_circular_buffer_evict(&aesd_device->buffer_storage))) {
+            aesd_chunk_put(tmp_buffptr);
+        }
+
+        write_seqcount_end(&aesd_device->seq);
+
 	aesd_device->buffer_entry.buffptr = NULL;
 	aesd_device->buffer_entry.size = 0;
     }
@@ -167,10 +356,9 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff
     goto end;
    
 fault:
-    if (NULL != aesd_device->buffer_entry.buffptr) {
-    	kfree(aesd_device->buffer_entry.buffptr);
-	aesd_device->buffer_entry.buffptr = NULL;
-    }
+    aesd_chunk_free(chunk);
+    aesd_device->buffer_entry.buffptr = NULL;
+    aesd_device->buffer_entry.size = 0;
 end:
     mutex_unlock(&aesd_device->lock);
     PDEBUG("aesd_write retval %zu with offset %lld",retval,*f_pos);
@@ -182,7 +370,11 @@ end:
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct aesd_dev *aesd_device = filp->private_data;
+    struct aesd_circular_buffer *buffer = &aesd_device->buffer_storage;
     struct aesd_seekto seek_ioctl = {0, 0};
+    unsigned int index;
+    unsigned int seq;
+    size_t skip;
 
     PDEBUG("aesd_ioctl ");
 
@@ -203,11 +395,18 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		
 	    PDEBUG("extracted cmd: %i, offset: %i ", seek_ioctl.write_cmd, seek_ioctl.write_cmd_offset);
 
-            while( (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED > seek_ioctl.write_cmd)  && (seek_ioctl.write_cmd > 0) ) {
-		    
-		PDEBUG("seek_ioctl.write_cmd: %d\n", --seek_ioctl.write_cmd);
-		filp->f_pos += aesd_device->buffer_storage.entry[seek_ioctl.write_cmd].size;
-	    }
+            // the commands are counted from the oldest one kept, the entry offsets give the start of any of them
+            do {
+                seq = read_seqcount_begin(&aesd_device->seq);
+                skip = 0;
+                if (seek_ioctl.write_cmd < buffer->count) {
+                    index = (buffer->out_offs + seek_ioctl.write_cmd) & buffer->mask;
+                    skip = buffer->entry[index].offset - buffer->entry[buffer->out_offs].offset;
+                }
+            }
+            while (read_seqcount_retry(&aesd_device->seq, seq));
+
+	    filp->f_pos += skip;
 
 	    filp->f_pos += seek_ioctl.write_cmd_offset;
 
@@ -227,6 +426,8 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
 {
     struct aesd_dev *aesd_device = filp->private_data;
     loff_t newpos;
+    unsigned int seq;
+    size_t size;
 
     PDEBUG("aesd_llseek with offset %lld (filp->f_po %lld)\n", off, filp->f_pos);
 
@@ -242,8 +443,14 @@ loff_t aesd_llseek(struct file *filp, loff_t off, int whence)
             break;
 
         case 2: // SEEK_END
-            newpos = off + aesd_circular_buffer_size(&aesd_device->buffer_storage);
-	    PDEBUG("aesd_llseek buffer size %zu", aesd_circular_buffer_size(&aesd_device->buffer_storage));
+            // the size of the content changes with every write and eviction, read with the rest of the ring
+            do {
+                seq = read_seqcount_begin(&aesd_device->seq);
+                size = aesd_circular_buffer_size(&aesd_device->buffer_storage);
+            }
+            while (read_seqcount_retry(&aesd_device->seq, seq));
+            newpos = off + size;
+	    PDEBUG("aesd_llseek buffer size %zu", size);
 	    PDEBUG("aesd_llseek SEEK_END %lld\n", off);
             break;
 
@@ -265,15 +472,21 @@ struct file_operations aesd_fops = {
     .owner          = THIS_MODULE,
     .llseek         = aesd_llseek,
     .read           = aesd_read,
+    .read_iter      = aesd_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+    .splice_read    = copy_splice_read,
+#else
+    .splice_read    = generic_file_splice_read,
+#endif
     .write          = aesd_write,
     .unlocked_ioctl = aesd_ioctl,
     .open           = aesd_open,
     .release        = aesd_release,
 };
 
-static int aesd_setup_cdev(struct aesd_dev *dev)
+static int aesd_setup_cdev(struct aesd_dev *dev, unsigned int index)
 {
-    int err, devno = MKDEV(aesd_major, aesd_minor);
+    int err, devno = MKDEV(aesd_major, aesd_minor + index);
     
     cdev_init(&dev->cdev, &aesd_fops);
     dev->cdev.owner = THIS_MODULE;
@@ -286,14 +499,78 @@ static int aesd_setup_cdev(struct aesd_dev *dev)
 }
 
 
-struct aesd_dev *aesd_device; /* need to be global between init and cleanup for proper memory free */
+struct aesd_dev *aesd_devices; /* need to be global between init and cleanup for proper memory free */
+unsigned int aesd_nr_devs;      /* the default instance and the named ones */
+
+/**
+ * Initialize an instance with an empty ring of ring_len entries, and make it available
+ * @return 0 on success, a negative errno otherwise (nothing left to release)
+ */
+static int aesd_setup_dev(struct aesd_dev *dev, unsigned int index, unsigned int ring_len)
+{
+    struct aesd_buffer_entry *ring;
+    int result;
+
+    mutex_init(&dev->lock);
+    seqcount_mutex_init(&dev->seq, &dev->lock);
+
+    // a power of 2 ring, its indexes wrap with a mask
+    ring = kcalloc(ring_len, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+    aesd_circular_buffer_init_ring(&dev->buffer_storage, ring, ring_len, max_entries, max_bytes);
+
+    result = aesd_setup_cdev(dev, index);
+    if (result)
+        kfree(ring);
+    return result;
+}
+
+/**
+ * Remove an instance set up by aesd_setup_dev() and free its content
+ */
+static void aesd_release_dev(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *tmp_entry = NULL;
+    unsigned int index = 0;
+
+    // no file operation can start anymore (the open ones hold the module), the memory can go
+    cdev_del(&dev->cdev);
+
+    AESD_CIRCULAR_BUFFER_FOREACH(tmp_entry, &dev->buffer_storage, index) {
+        if (NULL != tmp_entry->buffptr) {
+            aesd_chunk_free(aesd_chunk_of(tmp_entry->buffptr));
+        }
+    }
+
+    if (NULL != dev->buffer_entry.buffptr) {
+        aesd_chunk_free(aesd_chunk_of(dev->buffer_entry.buffptr));
+    }
+    kfree(dev->buffer_storage.entry);
+}
 
 int aesd_init_module(void)
 {
     dev_t dev = 0;
+    unsigned int ring_len;
+    unsigned int i;
     int result;
 
-    result = alloc_chrdev_region(&dev, aesd_minor, 1, DEVICE_NAME);
+    if ((0 == max_entries) || (AESD_MAX_ENTRIES_LIMIT < max_entries)) {
+        printk(KERN_WARNING "max_entries must be between 1 and %u\n", AESD_MAX_ENTRIES_LIMIT);
+        return -EINVAL;
+    }
+
+    // the names end up in device node paths
+    for (i = 0; i < nr_streams; i++) {
+        if (('\0' == streams[i][0]) || strchr(streams[i], '/')) {
+            printk(KERN_WARNING "stream name \"%s\" must be non empty, without '/'\n", streams[i]);
+            return -EINVAL;
+        }
+    }
+    aesd_nr_devs = 1 + nr_streams;
+
+    result = alloc_chrdev_region(&dev, aesd_minor, aesd_nr_devs, DEVICE_NAME);
     aesd_major = MAJOR(dev);
     if (result < 0) {
         printk(KERN_WARNING "Can't get major %d\n", aesd_major);
@@ -303,24 +580,41 @@ int aesd_init_module(void)
     /**
      * TODO: initialize the AESD specific portion of the device
      */
-    aesd_device = kzalloc(sizeof(struct aesd_dev), GFP_KERNEL);
-    if (!aesd_device) {
+    aesd_devices = kcalloc(aesd_nr_devs, sizeof(struct aesd_dev), GFP_KERNEL);
+    if (!aesd_devices) {
         result = -ENOMEM;
 	goto nomem;
     }
 
-    result = aesd_setup_cdev(aesd_device);
-    if( result ) {
-        goto nodev;
+    aesd_chunk_cache = kmem_cache_create("aesd_chunk", AESD_CHUNK_CACHED_LEN, 0, 0, NULL);
+    if (!aesd_chunk_cache) {
+        result = -ENOMEM;
+        goto nocache;
+    }
+
+    ring_len = roundup_pow_of_two(max_entries);
+    for (i = 0; i < aesd_nr_devs; i++) {
+        result = aesd_setup_dev(&aesd_devices[i], i, ring_len);
+        if (result) {
+            goto nodev;
+        }
+        if (i > 0)
+            printk(KERN_INFO "aesdchar: stream %s on minor %u\n", streams[i - 1], aesd_minor + i);
     }
+    printk(KERN_INFO "aesdchar: keeping %u write commands, %lu bytes (0: no limit)\n", max_entries, max_bytes);
 
     goto end;
 
 nodev:
-    kfree(aesd_device);
-    aesd_device = NULL;
+    // the instances set up before the failing one
+    while (i-- > 0)
+        aesd_release_dev(&aesd_devices[i]);
+    kmem_cache_destroy(aesd_chunk_cache);
+nocache:
+    kfree(aesd_devices);
+    aesd_devices = NULL;
 nomem:
-    unregister_chrdev_region(dev, 1);
+    unregister_chrdev_region(dev, aesd_nr_devs);
 end:
     return result;
 }
@@ -328,29 +622,24 @@ end:
 
 void aesd_cleanup_module(void)
 {
-    struct aesd_buffer_entry *tmp_entry = NULL;
-    uint8_t index = 0;
     dev_t devno = MKDEV(aesd_major, aesd_minor);
+    unsigned int i;
 
     /**
      * TODO: cleanup AESD specific poritions here as necessary
      */
-    if (aesd_device) {
-	AESD_CIRCULAR_BUFFER_FOREACH(tmp_entry, &aesd_device->buffer_storage, index) {
-            if (NULL != tmp_entry->buffptr) {
-                kfree(tmp_entry->buffptr);
-            }
-        }
+    if (aesd_devices) {
+        for (i = 0; i < aesd_nr_devs; i++)
+            aesd_release_dev(&aesd_devices[i]);
 
-        if (NULL != aesd_device->buffer_entry.buffptr) {
-            kfree(aesd_device->buffer_entry.buffptr);
-        }
+        // the chunks dropped lately may still wait for their grace period
+        rcu_barrier();
+        kmem_cache_destroy(aesd_chunk_cache);
 
-        cdev_del(&aesd_device->cdev);
-	kfree(aesd_device);
+	kfree(aesd_devices);
     }
 
-    unregister_chrdev_region(devno, 1);
+    unregister_chrdev_region(devno, aesd_nr_devs);
 }
 
 
@@ -0,0 +1,432 @@
+/**
+* Load generator and latency benchmark for aesdsocket
+* N concurrent clients send packets over loopback and wait for each reply, the round trips are measured
+* The server can be spawned by the benchmark (-x) so that its CPU time is reported as well
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define SOCKPORT        "9000"
+#define RECVLEN         (64 * 1024)
+#define CONNECT_TIMEOUT 5000        // ms waited for the server to listen
+
+#define ERROR_LOG(msg,...) fprintf(stderr, "ERROR: " msg "\n" , ##__VA_ARGS__)
+
+
+// Run time configuration, filled from the command line options
+struct benchconfig {
+    const char * host;          // -H host: server address (default 127.0.0.1)
+    unsigned int clients;       // -c N: concurrent clients
+    unsigned int packets;       // -n N: packets sent by each client
+    size_t size;                // -s bytes: packet size, '\n' included
+    unsigned int rate;          // -r N: packets per second of each client (0 sends as fast as the replies come)
+    pid_t serverpid;            // -p pid: server whose CPU time is reported (set when spawned with -x)
+} typedef benchconfig_t;
+
+benchconfig_t benchconfig = { "127.0.0.1", 8, 1000, 64, 0, 0 };
+
+struct client {
+    pthread_t pthread;
+    unsigned int id;
+    uint64_t * latencies;       // round trip of each packet (ns)
+    unsigned int done;          // packets answered
+    uint64_t received;          // reply bytes
+    bool failed;
+} typedef client_t;
+
+
+static void print_usage (const char * name)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-c clients] [-n packets] [-s size] [-r rate] [-p pid | -x server [-- server options]]\n", name);
+    fprintf(stderr, "  -H host     server address (default %s)\n", benchconfig.host);
+    fprintf(stderr, "  -c clients  concurrent connections (default %u)\n", benchconfig.clients);
+    fprintf(stderr, "  -n packets  packets sent by each client (default %u)\n", benchconfig.packets);
+    fprintf(stderr, "  -s size     packet size in bytes, '\\n' included (default %zu)\n", benchconfig.size);
+    fprintf(stderr, "  -r rate     packets per second of each client, 0 for closed loop (default)\n");
+    fprintf(stderr, "  -p pid      report the CPU time of this running server\n");
+    fprintf(stderr, "  -x server   spawn this server binary (with the options following --), then stop it\n");
+}
+
+
+static uint64_t now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * Connect to the server, retrying while it is starting
+ * @return the socket descriptor, -1 on error
+ */
+static int connect_server (void)
+{
+    struct addrinfo hints;
+    struct addrinfo * servinfo;
+    uint64_t deadline = now_ns() + (uint64_t) CONNECT_TIMEOUT * 1000000ULL;
+    int sockfd = -1;
+    int status;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+
+    status = getaddrinfo (benchconfig.host, SOCKPORT, &hints, &servinfo);
+    if (0 != status) {
+        ERROR_LOG("getaddrinfo(): %s {%s}", gai_strerror(status), __func__);
+        return -1;
+    }
+
+    while (-1 == sockfd) {
+        sockfd = socket (servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+        if (-1 == sockfd) {
+            ERROR_LOG("errno %d (%s) getting a socket {%s}", errno, strerror(errno), __func__);
+            break;
+        }
+
+        if (-1 == connect (sockfd, servinfo->ai_addr, servinfo->ai_addrlen)) {
+            close(sockfd);
+            sockfd = -1;
+            if ((ECONNREFUSED != errno) || (now_ns() > deadline)) {
+                ERROR_LOG("errno %d (%s) connecting to %s {%s}", errno, strerror(errno), benchconfig.host, __func__);
+                break;
+            }
+            usleep(10000);
+        }
+    }
+
+    freeaddrinfo (servinfo);
+    return sockfd;
+}
+
+
+/**
+ * Client thread: sends its packets one after the other, each reply ends with the packet just sent
+ */
+static void * client_thread (void * arg)
+{
+    client_t * client = (client_t * ) arg;
+    char * packet;
+    char * buffpt;
+    char * tail;
+    size_t tailed;
+    ssize_t count;
+    uint64_t start;
+    uint64_t next = now_ns();
+    uint64_t period = (0 == benchconfig.rate) ? 0 : (1000000000ULL / benchconfig.rate);
+    int sockfd;
+
+    packet = (char *) malloc(benchconfig.size);
+    buffpt = (char *) malloc(RECVLEN);
+    tail = (char *) malloc(benchconfig.size);
+    if ((NULL == packet) || (NULL == buffpt) || (NULL == tail)) {
+        ERROR_LOG("buffer allocation {%s}", __func__);
+        client->failed = true;
+        goto end;
+    }
+
+    sockfd = connect_server ();
+    if (-1 == sockfd) {
+        client->failed = true;
+        goto end;
+    }
+
+    memset(packet, 'a' + (client->id % 26), benchconfig.size);
+    packet[benchconfig.size - 1] = '\n';
+
+    for (unsigned int i = 0; i < benchconfig.packets; i++) {
+        if (0 != period) {
+            // paced: wait for the next slot, a late reply is not compensated
+            while (now_ns() < next) {
+                usleep((next - now_ns()) / 1000);
+            }
+            next += period;
+        }
+
+        // the packet is unique (client id and sequence number), so is the end of its reply
+        snprintf(packet, benchconfig.size, "%u:%u:", client->id, i);
+        packet[strlen(packet)] = 'a' + (client->id % 26);
+
+        start = now_ns();
+        if ((ssize_t) benchconfig.size != send(sockfd, packet, benchconfig.size, MSG_NOSIGNAL)) {
+            ERROR_LOG("errno %d (%s) send() {%s}", errno, strerror(errno), __func__);
+            client->failed = true;
+            break;
+        }
+
+        // read until the stream ends with the packet, the last bytes received are kept in tail
+        tailed = 0;
+        do {
+            count = recv(sockfd, buffpt, RECVLEN, 0);
+            if (0 >= count) {
+                ERROR_LOG("errno %d (%s) recv() (%zd) {%s}", errno, strerror(errno), count, __func__);
+                client->failed = true;
+                goto out;
+            }
+            client->received += count;
+
+            if ((size_t) count >= benchconfig.size) {
+                memcpy(tail, buffpt + count - benchconfig.size, benchconfig.size);
+                tailed = benchconfig.size;
+            }
+            else {
+                memmove(tail, tail + count, benchconfig.size - count);
+                memcpy(tail + benchconfig.size - count, buffpt, count);
+                tailed = (tailed + count < benchconfig.size) ? (tailed + count) : benchconfig.size;
+            }
+        }
+        while ((tailed < benchconfig.size) || (0 != memcmp(tail, packet, benchconfig.size)));
+
+        client->latencies[i] = now_ns() - start;
+        client->done++;
+    }
+
+    out:
+    close(sockfd);
+
+    end:
+    free(packet);
+    free(buffpt);
+    free(tail);
+    return NULL;
+}
+
+
+/**
+ * Read the CPU time (user and system, in clock ticks) consumed so far by a process
+ * @return 0 on success, -1 on error
+ */
+static int process_cpu (pid_t pid, unsigned long * utime, unsigned long * stime)
+{
+    char path[64];
+    char line[1024];
+    char * charpt;
+    FILE * file;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    file = fopen(path, "r");
+    if (NULL == file) {
+        return -1;
+    }
+    charpt = fgets(line, sizeof(line), file);
+    fclose(file);
+    if (NULL == charpt) {
+        return -1;
+    }
+
+    // fields 14 and 15, counted after the command name which may hold spaces
+    charpt = strrchr(line, ')');
+    if ((NULL == charpt) || (2 != sscanf(charpt + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", utime, stime))) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int compare_u64 (const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Fork and exec the server, its output is discarded
+ * @return the server pid, -1 on error
+ */
+static pid_t spawn_server (char ** argv)
+{
+    pid_t pid = fork ();
+
+    if (-1 == pid) {
+        ERROR_LOG("errno %d (%s) fork() {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    if (0 == pid) {
+        int nullfd = open ("/dev/null", O_RDWR);
+        if (-1 != nullfd) {
+            dup2(nullfd, STDOUT_FILENO);
+            dup2(nullfd, STDERR_FILENO);
+            close(nullfd);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+
+int main (int argc, char** argv)
+{
+    int success = EXIT_SUCCESS;
+    int opt;
+    pid_t spawned = -1;
+    client_t * clients = NULL;
+    uint64_t * latencies = NULL;
+    unsigned long utime[2] = { 0, 0 };
+    unsigned long stime[2] = { 0, 0 };
+    bool cpu = false;
+    uint64_t start;
+    double elapsed;
+    uint64_t received = 0;
+    unsigned int total = 0;
+    const char * server = NULL;
+    char ** serverargv = NULL;
+
+    while (-1 != (opt = getopt(argc, argv, "H:c:n:s:r:p:x:"))) {
+        switch (opt) {
+            case 'H':
+                benchconfig.host = optarg;
+                break;
+            case 'c':
+                benchconfig.clients = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                benchconfig.packets = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                benchconfig.size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                benchconfig.rate = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                benchconfig.serverpid = strtol(optarg, NULL, 10);
+                break;
+            case 'x':
+                server = optarg;
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // room for "id:seq:" and the '\n'
+    if ((0 == benchconfig.clients) || (0 == benchconfig.packets) || (24 > benchconfig.size)) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (NULL != server) {
+        // the server options are what follows "--"
+        serverargv = (char **) calloc(argc - optind + 2, sizeof(char *));
+        if (NULL == serverargv) {
+            ERROR_LOG("memory allocation {%s}", __func__);
+            exit(EXIT_FAILURE);
+        }
+        serverargv[0] = (char *) server;
+        for (int i = optind; i < argc; i++) {
+            serverargv[1 + i - optind] = argv[i];
+        }
+
+        spawned = spawn_server (serverargv);
+        free(serverargv);
+        if (-1 == spawned) {
+            exit(EXIT_FAILURE);
+        }
+        benchconfig.serverpid = spawned;
+    }
+
+    clients = (client_t *) calloc(benchconfig.clients, sizeof(client_t));
+    latencies = (uint64_t *) calloc((size_t) benchconfig.clients * benchconfig.packets, sizeof(uint64_t));
+    if ((NULL == clients) || (NULL == latencies)) {
+        ERROR_LOG("memory allocation {%s}", __func__);
+        success = EXIT_FAILURE;
+        goto end;
+    }
+
+    // wait for the server to listen before the clock starts
+    if (-1 != spawned) {
+        int sockfd = connect_server ();
+        if (-1 == sockfd) {
+            success = EXIT_FAILURE;
+            goto end;
+        }
+        close(sockfd);
+    }
+
+    if (0 != benchconfig.serverpid) {
+        cpu = (0 == process_cpu (benchconfig.serverpid, &utime[0], &stime[0]));
+    }
+
+    start = now_ns();
+    for (unsigned int i = 0; i < benchconfig.clients; i++) {
+        clients[i].id = i;
+        clients[i].latencies = latencies + ((size_t) i * benchconfig.packets);
+        if (0 != pthread_create(&clients[i].pthread, NULL, client_thread, &clients[i])) {
+            ERROR_LOG("creation of client thread #%u {%s}", i, __func__);
+            clients[i].pthread = 0;
+            clients[i].failed = true;
+        }
+    }
+
+    for (unsigned int i = 0; i < benchconfig.clients; i++) {
+        if (0 != clients[i].pthread) {
+            pthread_join(clients[i].pthread, NULL);
+        }
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    if (cpu) {
+        cpu = (0 == process_cpu (benchconfig.serverpid, &utime[1], &stime[1]));
+    }
+
+    // the answered packets of every client, gathered at the beginning of the table
+    for (unsigned int i = 0; i < benchconfig.clients; i++) {
+        memmove(latencies + total, clients[i].latencies, clients[i].done * sizeof(uint64_t));
+        total += clients[i].done;
+        received += clients[i].received;
+        if (clients[i].failed) {
+            success = EXIT_FAILURE;
+        }
+    }
+    qsort(latencies, total, sizeof(uint64_t), compare_u64);
+
+    printf("clients %u, packets %u x %zu bytes, rate %s\n", benchconfig.clients, benchconfig.packets, benchconfig.size,
+           (0 == benchconfig.rate) ? "closed loop" : "paced");
+    printf("answered   %u/%u packets in %.3f s\n", total, benchconfig.clients * benchconfig.packets, elapsed);
+    printf("throughput %.0f packets/s, sent %.2f MB/s, received %.2f MB/s\n", total / elapsed,
+           (double) total * benchconfig.size / elapsed / 1e6, received / elapsed / 1e6);
+    if (0 < total) {
+        printf("latency us p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n", latencies[(total - 1) * 50 / 100] / 1e3,
+               latencies[(total - 1) * 99 / 100] / 1e3, latencies[(total - 1) * 999 / 1000] / 1e3, latencies[total - 1] / 1e3);
+    }
+    if (cpu) {
+        long ticks = sysconf(_SC_CLK_TCK);
+        double user = (double) (utime[1] - utime[0]) / ticks;
+        double sys = (double) (stime[1] - stime[0]) / ticks;
+        printf("server cpu user %.2f s, sys %.2f s, %.0f%% of a core\n", user, sys, 100 * (user + sys) / elapsed);
+    }
+
+    end:
+    if (-1 != spawned) {
+        kill(spawned, SIGTERM);
+        waitpid(spawned, NULL, 0);
+    }
+
+    free(latencies);
+    free(clients);
+    exit (success);
+}
@@ -9,581 +9,4305 @@ static void signal_handler ( int signal_number )
 {
     int err = errno;
 
-    DEBUG_LOG("SIGNAL! SIGNAL! SIGNAL! %s {%s}", strsignal (signal_number), __func__);
+    // nothing logged from here: the thread ring may be in use by the interrupted code
     if ( signal_number == SIGINT || signal_number == SIGTERM) {
+        signal_caught = signal_number;
         signal_to_get_out = true;
     }
 
     errno = err;
 }
 
-#ifdef DO_TIMESTAMP
-void * timestamp_thread (void *handler)
+static void print_usage (const char * name)
 {
-    time_t  timenow;
-    int rc;
-    ssize_t count;
+    fprintf(stderr, "Usage: %s [-d] [-e eventloops] [-w workers] [-r listeners] [-c] [-s always|batch[:ms]|none] [-p] [-m port|path] [-t seconds] [-f format] [-g ms]\n"
+                    "       [-b bytes] [-q high[:low]] [-k rate[:burst]]\n", name);
+    fprintf(stderr, "  -d              run as a daemon\n");
+    fprintf(stderr, "  -e eventloops   serve clients from N epoll event loop threads instead of one thread per connection\n");
+    fprintf(stderr, "  -w workers      serve clients from a pool of N pre-spawned threads instead of one thread per connection\n");
+    fprintf(stderr, "  -r listeners    accept from N SO_REUSEPORT sockets, each with its own accept loop pinned to a core\n");
+    fprintf(stderr, "  -c              cursor mode: reply only with the content not sent to the client yet (file storage only)\n");
+    fprintf(stderr, "  -s policy       tmp file durability before replying: always (default) fdatasync each packet,\n");
+    fprintf(stderr, "                  batch[:ms] group commit with at most ms (default %d) of added latency, none\n", SYNC_DELAY);
+    fprintf(stderr, "  -p              keep the char device open for the whole connection instead of reopening it for each packet\n");
+    fprintf(stderr, "  -m port|path    serve the metrics (Prometheus text format) on a loopback TCP port or a Unix socket path\n");
+    fprintf(stderr, "  -t seconds      append a timestamp to the storage every N seconds (0 for none, default %d)\n", TIMESTAMP_INTERVAL);
+    fprintf(stderr, "  -f format       strftime() format of the timestamps (default \"%.*s\")\n", (int) strlen(TIMEBUFFFORMAT) - 1, TIMEBUFFFORMAT);
+    fprintf(stderr, "  -g ms           on SIGTERM/SIGINT, give the connections ms (default %d) to finish before cancelling them\n", DRAIN_DEADLINE);
+    fprintf(stderr, "  -b bytes        close the connections sending a packet longer than bytes (default no limit)\n");
+    fprintf(stderr, "  -q high[:low]   event loops stop reading a connection with high (default %d) reply bytes queued, until they\n", REPLY_HIGHWATER);
+    fprintf(stderr, "                  fall under low (default high/2), 0 for no limit\n");
+    fprintf(stderr, "  -k rate[:burst] at most rate packets per second for each connection, burst (default rate) at once\n");
+    fprintf(stderr, "  -l level        log level: none, error (default) or debug, SIGUSR1 toggles debug at run time\n");
+    fprintf(stderr, "  -o sink         log to stdout (default), syslog, or the file at the given path\n");
+    fprintf(stderr, "A connection whose first packet is \"%sname\" appends to the stream %s.name instead of %s\n", STREAM_CMD, TMPFILE, TMPFILE);
+}
 
-    handlers_t * hdl = (handlers_t *)handler;
 
-    hdl->buffpt = (char *) malloc(TIMEBUFFLEN * sizeof(char));
-    if (NULL == hdl->buffpt) {
-        ERROR_LOG("buffer memory allocation {%s}", __func__);
-        goto end;
+/**
+ * Write a message to the sink, right away
+ */
+static void log_emit (int level, const char * msg)
+{
+    if (LOGSINK_SYSLOG == logger.sink) {
+        syslog ((LOGLEVEL_ERROR == level) ? LOG_ERR : LOG_DEBUG, "%s", msg);
+    }
+    else {
+        fprintf((NULL != logger.file) ? logger.file : stdout, "%s\n", msg);
     }
+}
 
-    while ( !signal_to_get_out ) {
 
-        sleep(10);
+static void log_release (void * ring)
+{
+    atomic_store(&((logring_t *) ring)->inuse, false);
+}
 
-        timenow = time(NULL);
-        strftime(hdl->buffpt, (TIMEBUFFLEN * sizeof(char)), TIMEBUFFFORMAT, localtime(&timenow));
 
-        // Locking the file for writing
-        rc = pthread_mutex_lock(hdl->pmutex);
-        if ( rc != 0 ) {
-            ERROR_LOG("pthread_mutex_lock failed with %d {%s}", rc, __func__);
-            goto end;
-        }
+/**
+ * Find the ring of the calling thread: a ring released by a thread over, or a new one pushed on the list
+ * @return the ring, NULL if the heap is exhausted (the messages of the thread are written directly)
+ */
+static logring_t * log_local (void)
+{
+    logring_t * ring;
+    bool expected;
 
-        DEBUG_LOG("%s", hdl->buffpt);
-        count = write (*hdl->ptmpfd, hdl->buffpt, strlen(hdl->buffpt));
-        if (-1 == count) {
-            ERROR_LOG("write problem {%s}", __func__);
-            goto end;
+    // a ring not drained yet is left alone, a burst of short lived threads would fill it up
+    for (ring = atomic_load(&logger.rings); NULL != ring; ring = ring->next) {
+        expected = false;
+        if ((atomic_load(&ring->head) == atomic_load(&ring->tail))
+            && atomic_compare_exchange_strong(&ring->inuse, &expected, true)) {
+            break;
         }
+    }
 
-        rc = pthread_mutex_unlock(hdl->pmutex);
-        if ( rc != 0 ) {
-            ERROR_LOG("pthread_mutex_unlock failed with %d {%s}", rc, __func__);
-            goto end;
+    if (NULL == ring) {
+        ring = (logring_t *) calloc(1, sizeof(logring_t));
+        if (NULL == ring) {
+            return NULL;
         }
-    }
+        atomic_init(&ring->inuse, true);
 
-    end:
-    if (NULL != hdl->buffpt) {
-        DEBUG_LOG("FREE timestamp buffpt {%s}", __func__);
-        free(hdl->buffpt);
-        hdl->buffpt = NULL;
+        ring->next = atomic_load(&logger.rings);
+        while (!atomic_compare_exchange_weak(&logger.rings, &ring->next, ring));
     }
 
-    return NULL;
+    pthread_setspecific(logger.key, ring);
+    threadring = ring;
+    return threadring;
 }
-#endif
 
-void initialize_handler (handlers_t * hdl_table, unsigned int threadnumber, pthread_mutex_t * pmutex, int * ptmpfd)
+
+/**
+ * Format a message into the ring of the calling thread (dropped if the ring is full), or write it directly
+ * when the logger thread isn't running
+ */
+void log_write (int level, const char * format, ...)
 {
-    hdl_table[threadnumber].pmutex = pmutex;
-    hdl_table[threadnumber].ptmpfd = ptmpfd;
+    char msg[LOG_MSGLEN];
+    logring_t * ring = NULL;
+    logrecord_t * record;
+    unsigned int tail;
+    va_list args;
+
+    if (atomic_load_explicit(&logger.running, memory_order_acquire)) {
+        ring = (NULL != threadring) ? threadring : log_local ();
+    }
+
+    va_start(args, format);
+    if (NULL == ring) {
+        vsnprintf(msg, sizeof(msg), format, args);
+        log_emit (level, msg);
+    }
+    else {
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        if (LOG_RINGLEN <= tail - atomic_load_explicit(&ring->head, memory_order_acquire)) {
+            atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+        }
+        else {
+            record = &ring->records[tail & (LOG_RINGLEN - 1)];
+            record->level = level;
+            vsnprintf(record->msg, LOG_MSGLEN, format, args);
+            atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
 
-    hdl_table[threadnumber].pthread = 0;
-    hdl_table[threadnumber].buffpt = NULL;
-    hdl_table[threadnumber].clientfd = -1;
-    hdl_table[threadnumber].clentaddr = NULL;
+            // half full before the next drain, the logger is woken up early
+            if (LOG_RINGLEN / 2 == tail + 1 - atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+                pthread_cond_signal(&logger.cond);
+            }
+        }
+    }
+    va_end(args);
 }
 
 
-void clean_handlers (handlers_t * hdl_table, unsigned int threadcount)
+/**
+ * Write the messages waiting in every ring to the sink (logger thread only)
+ */
+static void log_drain (void)
 {
-    for (int i = 0; i < threadcount; i++)
-    {
-        if (0 != hdl_table[i].pthread) {
-            DEBUG_LOG("CANCEL thread #%d {%s}", i, __func__);
-            pthread_cancel(hdl_table[i].pthread);
+    unsigned long dropped;
+    unsigned int head;
+    unsigned int tail;
+    char msg[LOG_MSGLEN];
 
-            DEBUG_LOG("JOINING thread #%d {%s}", i, __func__);
-            pthread_join(hdl_table[i].pthread, NULL);
+    for (logring_t * ring = atomic_load(&logger.rings); NULL != ring; ring = ring->next) {
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
 
-            hdl_table[i].pthread = 0;
+        for (; head != tail; head++) {
+            log_emit (ring->records[head & (LOG_RINGLEN - 1)].level, ring->records[head & (LOG_RINGLEN - 1)].msg);
         }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
 
-        if (NULL != hdl_table[i].buffpt) {
-            DEBUG_LOG("FREE buffpt thread #%d {%s}", i, __func__);
-            free(hdl_table[i].buffpt);
-            hdl_table[i].buffpt = NULL;
+        dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported) {
+            snprintf(msg, sizeof(msg), "ERROR: %lu log messages dropped, ring full {%s}", dropped - ring->reported, __func__);
+            log_emit (LOGLEVEL_ERROR, msg);
+            ring->reported = dropped;
         }
+    }
 
-        if (-1 != hdl_table[i].clientfd) {
-            DEBUG_LOG("CLOSE clientfd thread #%d {%s}", i, __func__);
-            close(hdl_table[i].clientfd);
-            hdl_table[i].clientfd = -1;
-        }
+    if (LOGSINK_SYSLOG != logger.sink) {
+        fflush((NULL != logger.file) ? logger.file : stdout);
     }
 }
 
 
-int main (int argc, char** argv)
+/**
+ * Logger thread: drains the rings every LOG_FLUSHDELAY ms, and a last time when asked to quit
+ */
+void * logger_thread (void * arg)
 {
-    int success = EXIT_SUCCESS;
-    int status;
+    struct timespec deadline;
+    sigset_t sigset;
 
-    unsigned int threadnumber = 0;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    sigaddset(&sigset, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
 
-    // [1] Things to free or close are numbered with '[]'
-    openlog (NULL, 0, LOG_USER);
+    pthread_mutex_lock(&logger.mutex);
+    while (!logger.closing) {
+        pthread_mutex_unlock(&logger.mutex);
+        log_drain ();
+        pthread_mutex_lock(&logger.mutex);
 
-    // Signal management
-    struct sigaction new_action;
-    memset(&new_action, 0, sizeof(struct sigaction));
-    new_action.sa_handler=signal_handler;
-    if( sigaction(SIGTERM, &new_action, NULL) != 0 ) {
-        ERROR_LOG("errno %d (%s) registering for SIGTERM {%s}",errno,strerror(errno), __func__);
-        END (EXIT_FAILURE);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSHDELAY * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (!logger.closing) {
+            pthread_cond_timedwait(&logger.cond, &logger.mutex, &deadline);
+        }
     }
-    if( sigaction(SIGINT, &new_action, NULL) ) {
-        ERROR_LOG("errno %d (%s) registering for SIGINT {%s}",errno,strerror(errno), __func__);
-        END (EXIT_FAILURE);
+    pthread_mutex_unlock(&logger.mutex);
+
+    log_drain ();
+    return NULL;
+}
+
+
+/**
+ * Level thread: the only one taking SIGUSR1 (blocked everywhere), it toggles the log level between -l and debug
+ */
+void * loglevel_thread (void * arg)
+{
+    sigset_t sigset;
+    int signal_number;
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    // sigwait() is a cancellation point, stop_logger() ends the thread there
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    while (0 == sigwait(&sigset, &signal_number)) {
+        atomic_store(&logger.level, (LOGLEVEL_DEBUG == atomic_load(&logger.level)) ? logger.base : LOGLEVEL_DEBUG);
     }
 
+    return NULL;
+}
 
-    // [2] Socket preparation
-    struct addrinfo *servinfo = NULL;
-    int sockfd = -1;
 
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof hints);
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+/**
+ * Open the sink and start the logger thread, the messages keep being written directly if it can't start.
+ * The level thread is started first, SIGUSR1 toggles the level either way
+ * @return 0 on success, -1 if the log file can't be opened
+ */
+int start_logger (void)
+{
+    int status;
 
-    status = getaddrinfo (NULL, SOCKPORT, &hints, &servinfo);
+    status = pthread_create (&logger.levelthread, NULL, loglevel_thread, NULL);
     if (0 != status) {
-        ERROR_LOG("getaddrinfo(): %s {%s}", gai_strerror(status), __func__);
-        END (EXIT_FAILURE);
+        logger.levelthread = 0;
+        ERROR_LOG("creation of level thread code %d, SIGUSR1 ignored {%s}", status, __func__);
     }
 
-    // [3]
-    sockfd = socket (servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    if (-1 == sockfd) {
-        ERROR_LOG("errno %d (%s) getting a socket {%s}",errno,strerror(errno), __func__);
-        END (EXIT_FAILURE);
+    if (LOGSINK_FILE == logger.sink) {
+        logger.file = fopen(logger.path, "a");
+        if (NULL == logger.file) {
+            ERROR_LOG("errno %d (%s) opening the log file %s {%s}", errno, strerror(errno), logger.path, __func__);
+            return -1;
+        }
     }
 
-    status = bind (sockfd, servinfo->ai_addr, servinfo->ai_addrlen);
-    if (-1 == status) {
-        ERROR_LOG("errno %d (%s) binding to the socket {%s}",errno,strerror(errno), __func__);
-        END (EXIT_FAILURE);
+    status = pthread_key_create(&logger.key, log_release);
+    if (0 != status) {
+        ERROR_LOG("pthread_key_create failed with %d, logging synchronously {%s}", status, __func__);
+        return 0;
     }
 
-    status = listen (sockfd, BACKLOG);
-    if (-1 == status) {
-        ERROR_LOG("errno %d (%s) listening to the socket {%s}",errno,strerror(errno), __func__);
-        END (EXIT_FAILURE);
+    atomic_store(&logger.running, true);
+    status = pthread_create (&logger.pthread, NULL, logger_thread, NULL);
+    if (0 != status) {
+        atomic_store(&logger.running, false);
+        logger.pthread = 0;
+        pthread_key_delete(logger.key);
+        ERROR_LOG("creation of logger thread code %d, logging synchronously {%s}", status, __func__);
     }
 
+    return 0;
+}
 
 
-    // Daemon creation if requested
-    pid_t pid;
-    if (argc >= 2) {
-        if ( 0 == strcmp(argv[1], "-d") ) {
-            // Daemon option required
-            pid = fork ();
-            if (-1 == pid) {
-                ERROR_LOG("errno %d (%s) forking for daemon {%s}",errno,strerror(errno), __func__);
-                END (EXIT_FAILURE);
-            }
-            else if (0 != pid) { // Parent has to quit
-                // watchout DO NOT cleanup
-                exit(EXIT_SUCCESS);
-            }
+/**
+ * Drain the rings a last time and stop the logger thread, every other thread must be over.
+ * The next messages are written directly
+ */
+void stop_logger (void)
+{
+    logring_t * ring;
 
-            // Child reset
-            // create new session and process group
-            if (-1 == setsid ()) {
-                ERROR_LOG("errno %d (%s) creating daemon session & process group {%s}",errno,strerror(errno), __func__);
-                END (EXIT_FAILURE);
-            }
+    if (0 != logger.levelthread) {
+        pthread_cancel(logger.levelthread);
+        pthread_join(logger.levelthread, NULL);
+        logger.levelthread = 0;
+    }
 
-            // set the working directory to the root directory
-            if (-1 == chdir ("/")) {
-                ERROR_LOG("errno %d (%s) setting daemon root directory {%s}",errno,strerror(errno), __func__);
-                END (EXIT_FAILURE);
-            }
+    if (0 != logger.pthread) {
+        atomic_store(&logger.running, false);
 
-            // close all open files--NR_OPEN is overkill, but works
-            close(STDIN_FILENO);
-            close(STDOUT_FILENO);
-            close(STDERR_FILENO);
+        pthread_mutex_lock(&logger.mutex);
+        logger.closing = true;
+        pthread_cond_signal(&logger.cond);
+        pthread_mutex_unlock(&logger.mutex);
 
-            // redirect fd's 0,1,2 to /dev/null
-            open ("/dev/null", O_RDWR);   // stdin
-            open ("/dev/null", O_RDWR);   // stdout
-            open ("/dev/null", O_RDWR);   // stderr
+        pthread_join(logger.pthread, NULL);
+        logger.pthread = 0;
+
+        while (NULL != (ring = atomic_load(&logger.rings))) {
+            atomic_store(&logger.rings, ring->next);
+            free(ring);
         }
+        threadring = NULL;
+        pthread_key_delete(logger.key);
     }
 
-    // [4] messaging file storage creation
-    int tmpfd = -1;
-#ifndef USE_AESD_CHAR_DEVICE
-    tmpfd = open (TMPFILE, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-    if (-1 == tmpfd) {
-        ERROR_LOG("errno %d (%s) opening the tmp file {%s}", errno, strerror(errno), __func__);
-        END (EXIT_FAILURE);
+    // the log file stays open for the last messages, exit() closes it
+    if (NULL != logger.file) {
+        fflush(logger.file);
     }
-#endif
+}
 
-    // file protected by mutex
-    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+void initialize_handler (handlers_t * hdl, storage_t * storage)
+{
+    hdl->storage = storage;
+    hdl->selected = false;
 
+    hdl->pthread = 0;
+    hdl->buffpt = NULL;
+    hdl->clientfd = -1;
+    hdl->cursor = 0;
+    hdl->pipefd[0] = -1;
+    hdl->pipefd[1] = -1;
+    hdl->devfd = -1;
+    hdl->clentaddr[0] = '\0';
 
-    // [5] Threads, buffers, and descriptors structure table
-    // The tmp file and the mutex address will be passed to everybody and can be cleaned or reset by anybody
-    // The table will collect memory buffer and socket descriptor for further cleanup
-    handlers_t * hdl_table = NULL;
-    hdl_table = (handlers_t *) malloc((BACKLOG+1) * sizeof (handlers_t));
-    if (NULL == hdl_table) {
-        ERROR_LOG("handlers_t table memory allocation {%s}", __func__);
-        END (EXIT_FAILURE);
-    }
+    hdl->buffsize = 0;
+    hdl->bufflen = 0;
+    hdl->scanned = 0;
+    hdl->eof = false;
+    hdl->events = 0;
+    hdl->replyhead = NULL;
+    hdl->replytail = NULL;
+    hdl->replyfree = NULL;
+    hdl->loop = NULL;
+    hdl->held = false;
+    hdl->heldnext = NULL;
+    hdl->queued = 0;
+    hdl->paused = false;
+    hdl->throttled = false;
+    hdl->throttlednext = NULL;
+    hdl->resume = 0;
+    hdl->tokens = config.burst;
+    hdl->refilled = (0 < config.rate) ? metrics_clock () : 0;
+}
 
 
-    // the 1st thread created is reserved for the 10 sec timestamp
-    threadnumber = 0;
-    initialize_handler (hdl_table, threadnumber, &mutex, &tmpfd);
-#ifdef DO_TIMESTAMP
-    status = pthread_create (&hdl_table[0].pthread, NULL, timestamp_thread, (void *) &hdl_table[0]);
-    if (0 != status) {
-        ERROR_LOG("creation of timestamp thread code %d {%s}", status, __func__);
-        END (EXIT_FAILURE);
-    }
-#endif
+/**
+ * Free the buffers and close the socket held by a handler (its thread, if any, must be over)
+ */
+void release_handler (handlers_t * hdl)
+{
+    reply_t * reply;
+    int cancelstate;
 
-    /*
-     * timer_create even after a call to timer_delete was generating a leakage report in valgrind
-     *
-    timer_t timerid;
+    while (NULL != hdl->replyhead) {
+        reply = hdl->replyhead;
+        hdl->replyhead = reply->next;
+        bufpool_put (&bufpool, reply->buffpt);
+        free(reply);
+    }
+    hdl->replytail = NULL;
 
-    struct sigevent sev;
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = timer_thread;
-    sev.sigev_value.sival_ptr = &hdl_table[0];
+    while (NULL != hdl->replyfree) {
+        reply = hdl->replyfree;
+        hdl->replyfree = reply->next;
+        bufpool_put (&bufpool, reply->buffpt);
+        free(reply);
+    }
 
-    status = timer_create (CLOCK_REALTIME, &sev, &timerid);
-    if (0 != status) {
-        ERROR_LOG("errno %d (%s) timer_create {%s}", errno, strerror(errno), __func__);
-        END (EXIT_FAILURE);
+    if (NULL != hdl->buffpt) {
+        DEBUG_LOG("FREE buffpt {%s}", __func__);
+        bufpool_put (&bufpool, hdl->buffpt);
+        hdl->buffpt = NULL;
     }
 
-    struct itimerspec itimerspec;
-    memset(&itimerspec, 0, sizeof(struct itimerspec));
-    itimerspec.it_value.tv_sec = 10;
-    itimerspec.it_interval.tv_sec = 10;
+    if (-1 != hdl->clientfd) {
+        DEBUG_LOG("CLOSE clientfd {%s}", __func__);
+        // the drain shuts the live sockets down under the registry mutex, the descriptor can't be reused meanwhile
+        // (close() is a cancellation point, the mutex must not stay locked)
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+        pthread_mutex_lock(&hdl->registry->mutex);
+        close(hdl->clientfd);
+        hdl->clientfd = -1;
+        pthread_mutex_unlock(&hdl->registry->mutex);
+        pthread_setcancelstate(cancelstate, NULL);
+        METRIC_ADD(METRIC_CLOSED, 1);
+    }
 
-    status = timer_settime(timerid, TIMER_ABSTIME, &itimerspec, NULL );
-    if (0 != status) {
-        ERROR_LOG("errno %d (%s) timer_settime {%s}", errno, strerror(errno), __func__);
-        END (EXIT_FAILURE);
+    if (-1 != hdl->devfd) {
+        DEBUG_LOG("CLOSE devfd {%s}", __func__);
+        close(hdl->devfd);
+        hdl->devfd = -1;
     }
-    */
 
+    if (-1 != hdl->pipefd[0]) {
+        close(hdl->pipefd[0]);
+        close(hdl->pipefd[1]);
+        hdl->pipefd[0] = -1;
+        hdl->pipefd[1] = -1;
+    }
+}
 
-    // [5'] Accept continuously new connections and start for each for one a new server-client applicative thread
-    struct sockaddr their_addr;
-    socklen_t addr_size = sizeof (their_addr);
 
-    while ( !signal_to_get_out ) {
+/**
+ * Stop every live handler: threads are cancelled and joined, buffers freed and sockets closed
+ */
+void clean_handlers (registry_t * registry)
+{
+    handlers_t * hdl;
+    handlers_t * live;
 
-        // handlers table reallocation to prepare for a new applicative thread launched by accepting a connection
-        threadnumber++;
-        initialize_handler (hdl_table, threadnumber, &mutex, &tmpfd);
+    // Take the live list over: the threads still running won't retire themselves anymore. Their sockets are shut
+    // down, a thread blocked in sendfile() or splice() (not cancellation points) then returns
+    pthread_mutex_lock(&registry->mutex);
+    live = registry->live;
+    registry->live = NULL;
+    registry->closing = true;
+    for (hdl = live; NULL != hdl; hdl = hdl->next) {
+        if (-1 != hdl->clientfd) {
+            shutdown(hdl->clientfd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&registry->mutex);
 
+    while (NULL != live) {
+        hdl = live;
+        live = hdl->next;
 
-        memset(&their_addr, 0, addr_size);
-        status = accept(sockfd, &their_addr, &addr_size);
-        if (-1 == status) {
-            if(EINTR == errno){
-                DEBUG_LOG("errno %d (%s) catch of EINTR in accept() {%s}", errno, strerror(errno), __func__);
-                END (EXIT_SUCCESS);
-            }
-            if(signal_to_get_out){
-                DEBUG_LOG("errno %d (%s) catch of EINTR in accept() [I had treated it] {%s}", errno, strerror(errno), __func__);
-                END (EXIT_SUCCESS);
-            }
-            ERROR_LOG("errno %d (%s) accepting socket {%s}", errno, strerror(errno), __func__);
-            END (EXIT_FAILURE);
-        }
+        if (0 != hdl->pthread) {
+            DEBUG_LOG("CANCEL thread %lu {%s}", (unsigned long) hdl->pthread, __func__);
+            pthread_cancel(hdl->pthread);
 
-        hdl_table[threadnumber].clientfd = status;
-        hdl_table[threadnumber].clentaddr = inet_ntoa( ((struct sockaddr_in *)&their_addr)->sin_addr );
+            DEBUG_LOG("JOINING thread %lu {%s}", (unsigned long) hdl->pthread, __func__);
+            pthread_join(hdl->pthread, NULL);
 
-        status = pthread_create (&hdl_table[threadnumber].pthread, NULL, server_client_app, (void *) &hdl_table[threadnumber]);
-        if (0 != status) {
-            ERROR_LOG("creation of server/client app thread code %d {%s}", status, __func__);
-            END (EXIT_FAILURE);
+            hdl->pthread = 0;
         }
+
+        release_handler (hdl);
     }
 
+    // The threads which were over before
+    registry_reap (registry);
+}
 
-    // Exit cleanup management
-    end:
-    DEBUG_LOG("GOODBYE :)");
 
-    // [5]
-    if (NULL != hdl_table) {
-        clean_handlers(hdl_table, threadnumber + 1);
+void registry_init (registry_t * registry)
+{
+    memset(registry, 0, sizeof(registry_t));
+    pthread_mutex_init(&registry->mutex, NULL);
+    pthread_cond_init(&registry->drained, NULL);
+}
 
-        DEBUG_LOG("FREE hdl_table {%s}", __func__);
-        free(hdl_table);
-        hdl_table = NULL;
-    }
 
-#ifndef USE_AESD_CHAR_DEVICE
-    // [4]
-    DEBUG_LOG("CLOSE tmp file {%s}", __func__);
-    close (tmpfd);
-    tmpfd = -1;
-#endif
+/**
+ * Get a handler from the free list (a new slab is allocated when empty) and link it to the live ones
+ * @return the initialized handler, or NULL on allocation failure
+ */
+handlers_t * registry_acquire (registry_t * registry, storage_t * storage)
+{
+    handlers_t * hdl = NULL;
+    slab_t * slab;
 
-    // [3]
-    if (-1 != sockfd) {
-        DEBUG_LOG("SHUTDOWN socketfd {%s}", __func__);
-        shutdown(sockfd, SHUT_RDWR);
-        //close (sockfd);
+    pthread_mutex_lock(&registry->mutex);
+
+    if (NULL == registry->freelist) {
+        slab = (slab_t *) malloc(sizeof(slab_t));
+        if (NULL == slab) {
+            ERROR_LOG("slab_t memory allocation {%s}", __func__);
+            goto unlock;
+        }
+
+        slab->hdl = (handlers_t *) malloc(REGISTRY_SLABLEN * sizeof(handlers_t));
+        if (NULL == slab->hdl) {
+            ERROR_LOG("slab of handlers memory allocation {%s}", __func__);
+            free(slab);
+            goto unlock;
+        }
+
+        slab->next = registry->slabs;
+        registry->slabs = slab;
+
+        for (int i = 0; i < REGISTRY_SLABLEN; i++) {
+            slab->hdl[i].next = registry->freelist;
+            registry->freelist = &slab->hdl[i];
+        }
     }
 
-    // [2]
-    if (NULL != servinfo) {
-        DEBUG_LOG("FREE service info {%s}", __func__);
-        freeaddrinfo (servinfo);
+    hdl = registry->freelist;
+    registry->freelist = hdl->next;
+
+    hdl->prev = NULL;
+    hdl->next = registry->live;
+    if (NULL != registry->live) {
+        registry->live->prev = hdl;
     }
+    registry->live = hdl;
+    registry->livecount++;
 
-    // [1]
-    DEBUG_LOG("CLOSE syslog {%s}", __func__);
-    closelog();
+    hdl->registry = registry;
+    initialize_handler (hdl, storage);
 
-    DEBUG_LOG("success = %d {%s}", success, __func__);
-    exit (success);
+    unlock:
+    pthread_mutex_unlock(&registry->mutex);
+    return hdl;
 }
 
 
+static void registry_unlink (registry_t * registry, handlers_t * hdl)
+{
+    if (NULL != hdl->prev) {
+        hdl->prev->next = hdl->next;
+    }
+    else {
+        registry->live = hdl->next;
+    }
+    if (NULL != hdl->next) {
+        hdl->next->prev = hdl->prev;
+    }
+
+    registry->livecount--;
+}
+
 
-void * server_client_app (void * handler /*int friendfd, char * client_addr, int tmpfd, pthread_mutex_t * pmutex*/)
+/**
+ * Give a live handler back to the free list, its resources must have been released
+ */
+void registry_release (registry_t * registry, handlers_t * hdl)
 {
-    int ret;
+    pthread_mutex_lock(&registry->mutex);
 
-    ssize_t towrite;
-    ssize_t count;
-    int buffercount = 0;
+    if (!registry->closing) {
+        registry_unlink (registry, hdl);
 
-    char *charpt; // will be a pointer on the identified '\n' character position
-    char *tmppt; // will be a temporary pointer to safely reallocate the buffer
+        hdl->next = registry->freelist;
+        registry->freelist = hdl;
+    }
+    if (registry->draining) {
+        pthread_cond_signal(&registry->drained);
+    }
 
-    off_t filepos;
-    ssize_t written;
+    pthread_mutex_unlock(&registry->mutex);
+}
 
-    handlers_t * hdl = (handlers_t *)handler;
 
+/**
+ * Called by a client thread as its very last action: the handler waits in the zombies for the thread to be joined
+ */
+void registry_retire (registry_t * registry, handlers_t * hdl)
+{
+    pthread_mutex_lock(&registry->mutex);
 
-    syslog (LOG_DEBUG, "Accepted connection from %s", hdl->clentaddr);
+    if (!registry->closing) {
+        registry_unlink (registry, hdl);
 
-    // Loop back to receive once response sent
-    while ( !signal_to_get_out ) {
-        // Loop reception until a '\n' is obtained. Then will write everything to the tmp file
+        hdl->next = registry->zombies;
+        registry->zombies = hdl;
+    }
+    if (registry->draining) {
+        pthread_cond_signal(&registry->drained);
+    }
 
-        if (NULL == hdl->buffpt) {
-            hdl->buffpt = (char *)malloc(BUFFLEN * sizeof(char));
+    pthread_mutex_unlock(&registry->mutex);
+}
 
-            if (NULL == hdl->buffpt) {
-                ERROR_LOG("buffer dynamic allocation failed {%s}", __func__);
-                goto end;
-            }
 
-            buffercount = 1;
-        }
+/**
+ * Join the threads which retired their handler and recycle those handlers
+ */
+void registry_reap (registry_t * registry)
+{
+    handlers_t * hdl;
+    handlers_t * zombies;
 
-        towrite = 0;
+    pthread_mutex_lock(&registry->mutex);
+    zombies = registry->zombies;
+    registry->zombies = NULL;
+    pthread_mutex_unlock(&registry->mutex);
 
-        // Reception (blocking) as many buffer length as necessary to obtain a \n before processing
-        while( (0 == towrite) && !signal_to_get_out) {
-            count = recv(hdl->clientfd, (hdl->buffpt + ((buffercount-1)*BUFFLEN)), BUFFLEN, 0);
-            if (-1 == count) {
-                if(EINTR == errno){
-                    DEBUG_LOG("errno %d (%s) catch of EINTR in recv() {%s}", errno, strerror(errno), __func__);
-                    goto end;
-                }
-                if(signal_to_get_out){
-                    DEBUG_LOG("errno %d (%s) catch of EINTR in recv() [I treated it] {%s}", errno, strerror(errno), __func__);
-                    goto end;
-                }
-                ERROR_LOG("errno %d (%s) recv() {%s}", errno, strerror(errno), __func__);
-                goto end;
-            }
-            else if (0 == count) {
-                // client disconnected, let's terminate
-                DEBUG_LOG("client disconnected (descriptor %d) {%s}", hdl->clientfd, __func__);
-                goto end;
-            }
-
-            charpt = strchr(hdl->buffpt, '\n');
-            if(NULL == charpt) {
-                // no newline, allocation of another buffer
-                buffercount++;
-                tmppt = realloc(hdl->buffpt, (buffercount * BUFFLEN) * sizeof(char));
-                if (NULL == tmppt) {
-                    ERROR_LOG("buffer reallocation failed {%s}", __func__);
-                    goto end;
-                }
-                hdl->buffpt = tmppt;
-            }
-            else {
-                towrite = charpt - hdl->buffpt + 1;
-            }
-        }
+    while (NULL != zombies) {
+        hdl = zombies;
+        zombies = hdl->next;
 
-        ret = pthread_mutex_lock(hdl->pmutex);
-        if ( ret != 0 ) {
-            ERROR_LOG("pthread_mutex_lock failed with %d {%s}", ret, __func__);
-            goto end;
-        }
+        pthread_join(hdl->pthread, NULL);
+        hdl->pthread = 0;
 
-#ifndef USE_AESD_CHAR_DEVICE
-        // Positioning at the end of the tmp file to append data
-        filepos = lseek (*hdl->ptmpfd, 0, SEEK_END);
-        if (-1 == filepos) {
-            ERROR_LOG("errno %d (%s) lseek() EOF {%s}", errno, strerror(errno), __func__);
-            goto end;
-        }
-#else
-        if (NULL == strstr(hdl->buffpt, AESDCHAR_SEEK_CMD)) {
-            // if it' s not an ioctl command open char device, write buffer, and close
-            DEBUG_LOG("not ioctl open %s", TMPFILE);
-	    *hdl->ptmpfd = open (TMPFILE, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-            if (-1 == *hdl->ptmpfd) {
-                ERROR_LOG("errno %d (%s) opening the tmp file {%s}", errno, strerror(errno), __func__);
-                goto end;
-            }
-#endif
-            DEBUG_LOG("write %s", TMPFILE);
-            // Write buffer to the file managing potential incomplete write
-            tmppt = hdl->buffpt;
-            while(towrite > 0) {
-	        DEBUG_LOG("towrite %zu", towrite);
-                count = write (*hdl->ptmpfd, tmppt, towrite);
-	        DEBUG_LOG("count %zu", count);
-                if (-1 == count) {
-                    if(EINTR == errno){
-                        DEBUG_LOG("errno %d (%s) catch of EINTR in write() {%s}", errno, strerror(errno), __func__);
-                        goto end;
-                    }
-                    if(signal_to_get_out){
-                        DEBUG_LOG("errno %d (%s) catch of EINTR in write() [I had treated it] {%s}", errno, strerror(errno), __func__);
-                        goto end;
-                    }
-                    ERROR_LOG("errno %d (%s) write() {%s}", errno, strerror(errno), __func__);
-                    goto end;
-                }
-                tmppt += count;
-                towrite -= count;
-            }
-#ifdef USE_AESD_CHAR_DEVICE
+        pthread_mutex_lock(&registry->mutex);
+        hdl->next = registry->freelist;
+        registry->freelist = hdl;
+        pthread_mutex_unlock(&registry->mutex);
+    }
+}
 
-	    DEBUG_LOG("close %s", TMPFILE);
-            close (*hdl->ptmpfd);
-            *hdl->ptmpfd = -1;
-#endif
 
-        // Read and send back the complete file
-        //memset(hdl->buffpt, 0, (buffercount * BUFFLEN) * sizeof(char));
+static unsigned int registry_connections (registry_t * registry)
+{
+    unsigned int count = 0;
 
-#ifndef USE_AESD_CHAR_DEVICE
-        // Current position is the end of file, how much do we have to send ? Storing that in {count}
-        count = lseek (*hdl->ptmpfd, 0, SEEK_CUR);
-        if (-1 == count) {
-            ERROR_LOG("errno %d (%s) lseek() CURR {%s}", errno, strerror(errno), __func__);
-            goto end;
-        }
+    for (handlers_t * hdl = registry->live; NULL != hdl; hdl = hdl->next) {
+        count += (-1 != hdl->clientfd) ? 1 : 0;
+    }
 
-        // Positioning at the beginning to send back the full content
-        filepos = lseek (*hdl->ptmpfd, 0, SEEK_SET);
-        if (-1 == filepos) {
-            ERROR_LOG("errno %d (%s) lseek() START {%s}", errno, strerror(errno), __func__);
-            goto end;
-        }
-#else
-	}
+    return count;
+}
 
-	// open char device, write buffer, and close it
-        *hdl->ptmpfd = open (TMPFILE, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-        if (-1 == *hdl->ptmpfd) {
-            ERROR_LOG("errno %d (%s) opening the tmp file {%s}", errno, strerror(errno), __func__);
-            goto end;
-        }
 
-        if (NULL != strstr(hdl->buffpt, AESDCHAR_SEEK_CMD)) {
-            struct aesd_seekto seek_ioctl = {0, 0};
-            
-	    DEBUG_LOG("ioctl string: %s", hdl->buffpt);
-            
-	    sscanf(hdl->buffpt, AESDCHAR_SEEK_CMD "%i,%i\n", &seek_ioctl.write_cmd, &seek_ioctl.write_cmd_offset);
-            
-	    DEBUG_LOG("ioctl cmd: %i, offset: %i", seek_ioctl.write_cmd, seek_ioctl.write_cmd_offset);
+/**
+ * Start draining the live connections once the listeners are stopped: their reception side is shut down, so the idle
+ * ones read the end of the stream and the busy ones finish the batch in flight, its reply included
+ */
+void registry_drain_start (registry_t * registry)
+{
+    pthread_mutex_lock(&registry->mutex);
+    registry->draining = true;
 
-            ioctl(*hdl->ptmpfd, AESDCHAR_IOCSEEKTO, &seek_ioctl);
-	}
+    for (handlers_t * hdl = registry->live; NULL != hdl; hdl = hdl->next) {
+        if (-1 != hdl->clientfd) {
+            shutdown(hdl->clientfd, SHUT_RD);
+        }
+    }
 
-	count = BUFFLEN;
-#endif
+    pthread_mutex_unlock(&registry->mutex);
+}
 
-	// Read and send back the complete file
-        memset(hdl->buffpt, 0, (buffercount * BUFFLEN) * sizeof(char));
 
-        while(count > 0) {
-            filepos = read (*hdl->ptmpfd, hdl->buffpt, (count <= BUFFLEN) ? count : BUFFLEN);
-            if (-1 == filepos) {
-                perror("Error server client app: read()");
-                goto end;
-            }
-	    else if (0 == filepos) {
+/**
+ * Wait until every connection being drained is closed, or until timeout (CLOCK_REALTIME)
+ * @return the connections still open at the deadline
+ */
+unsigned int registry_drain_wait (registry_t * registry, const struct timespec * timeout)
+{
+    unsigned int open;
+
+    pthread_mutex_lock(&registry->mutex);
+
+    while (0 != (open = registry_connections (registry))) {
+        if (ETIMEDOUT == pthread_cond_timedwait(&registry->drained, &registry->mutex, timeout)) {
+            open = registry_connections (registry);
+            break;
+        }
+    }
+
+    registry->draining = false;
+    pthread_mutex_unlock(&registry->mutex);
+
+    return open;
+}
+
+
+/**
+ * Free every slab, no handler may be in use anymore
+ */
+void registry_destroy (registry_t * registry)
+{
+    slab_t * slab;
+
+    while (NULL != registry->slabs) {
+        slab = registry->slabs;
+        registry->slabs = slab->next;
+
+        free(slab->hdl);
+        free(slab);
+    }
+
+    pthread_mutex_destroy(&registry->mutex);
+    pthread_cond_destroy(&registry->drained);
+}
+
+
+/**
+ * Allocate the pool buffers and chain them all in the free list.
+ * Without memory the pool stays empty and every buffer comes from the heap
+ */
+void bufpool_init (bufpool_t * pool)
+{
+    uint32_t index;
+
+    atomic_init(&pool->head, POOL_NIL);
+    atomic_init(&pool->hits, 0);
+    atomic_init(&pool->misses, 0);
+
+    pool->slab = (char *) malloc(POOL_BUFFERS * POOL_BUFFLEN * sizeof(char));
+    pool->next = (_Atomic uint32_t *) malloc(POOL_BUFFERS * sizeof(*pool->next));
+    if ((NULL == pool->slab) || (NULL == pool->next)) {
+        ERROR_LOG("buffer pool allocation failed {%s}", __func__);
+        free(pool->slab);
+        free((void *) pool->next);
+        pool->slab = NULL;
+        pool->next = NULL;
+        return;
+    }
+
+    for (index = 0; index < POOL_BUFFERS; index++) {
+        atomic_init(&pool->next[index], (index + 1 < POOL_BUFFERS) ? (index + 1) : POOL_NIL);
+    }
+    atomic_store(&pool->head, 0);
+}
+
+
+/**
+ * Take a buffer of POOL_BUFFLEN bytes, from the pool if it isn't empty
+ * @return the buffer, NULL if the heap is exhausted as well
+ */
+char * bufpool_get (bufpool_t * pool)
+{
+    uint64_t head = atomic_load(&pool->head);
+    uint64_t newhead;
+    uint32_t index;
+
+    do {
+        index = (uint32_t) head;
+        if (POOL_NIL == index) {
+            atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+            return (char *) malloc(POOL_BUFFLEN * sizeof(char));
+        }
+        // a stale link is harmless: the tag changed and the exchange fails
+        newhead = (((head >> 32) + 1) << 32) | atomic_load_explicit(&pool->next[index], memory_order_relaxed);
+    }
+    while (!atomic_compare_exchange_weak(&pool->head, &head, newhead));
+
+    atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+    return pool->slab + ((size_t) index * POOL_BUFFLEN);
+}
+
+
+/**
+ * Tell if a buffer belongs to the pool
+ */
+bool bufpool_owns (bufpool_t * pool, const char * buffpt)
+{
+    return (NULL != pool->slab) && (buffpt >= pool->slab) && (buffpt < pool->slab + ((size_t) POOL_BUFFERS * POOL_BUFFLEN));
+}
+
+
+/**
+ * Give a buffer back: pool buffers return to the free list, any other one is freed
+ */
+void bufpool_put (bufpool_t * pool, char * buffpt)
+{
+    uint64_t head;
+    uint64_t newhead;
+    uint32_t index;
+
+    if (!bufpool_owns (pool, buffpt)) {
+        free(buffpt);
+        return;
+    }
+
+    index = (buffpt - pool->slab) / POOL_BUFFLEN;
+    head = atomic_load(&pool->head);
+    do {
+        atomic_store_explicit(&pool->next[index], (uint32_t) head, memory_order_relaxed);
+        newhead = (((head >> 32) + 1) << 32) | index;
+    }
+    while (!atomic_compare_exchange_weak(&pool->head, &head, newhead));
+}
+
+
+/**
+ * Grow a buffer holding len bytes: the first one is a pool buffer, then it doubles on the heap (a pool buffer can't
+ * be reallocated, its content moves)
+ * @param buffpt the buffer (NULL for a new one), buffsize its allocated length (0 for a new one)
+ * @return 0 on success, -1 if out of memory (the buffer is left untouched)
+ */
+int bufpool_grow (bufpool_t * pool, char ** buffpt, size_t * buffsize, size_t len)
+{
+    char * tmppt;
+    size_t newsize;
+
+    if (0 == *buffsize) {
+        tmppt = bufpool_get (pool);
+        newsize = POOL_BUFFLEN;
+    }
+    else if (POOL_BUFFLEN == *buffsize) {
+        newsize = 2 * *buffsize;
+        tmppt = (char *) malloc(newsize * sizeof(char));
+        if (NULL != tmppt) {
+            memcpy(tmppt, *buffpt, len);
+            bufpool_put (pool, *buffpt);
+        }
+    }
+    else {
+        newsize = 2 * *buffsize;
+        tmppt = realloc(*buffpt, newsize * sizeof(char));
+    }
+
+    if (NULL == tmppt) {
+        return -1;
+    }
+    if (0 != *buffsize) {
+        METRIC_ADD(METRIC_REALLOCS, 1);
+    }
+    *buffpt = tmppt;
+    *buffsize = newsize;
+
+    return 0;
+}
+
+
+/**
+ * Log the pool statistics and free it, no buffer may be in use anymore
+ */
+void bufpool_destroy (bufpool_t * pool)
+{
+    syslog (LOG_DEBUG, "Buffer pool: %lu hits, %lu misses", atomic_load(&pool->hits), atomic_load(&pool->misses));
+    DEBUG_LOG("buffer pool: %lu hits, %lu misses {%s}", atomic_load(&pool->hits), atomic_load(&pool->misses), __func__);
+
+    free(pool->slab);
+    free((void *) pool->next);
+    pool->slab = NULL;
+    pool->next = NULL;
+}
+
+
+static void metrics_release (void * metrics)
+{
+    atomic_store(&((metrics_t *) metrics)->inuse, false);
+}
+
+
+/**
+ * Prepare the release of the counter blocks by their exiting threads
+ */
+void metrics_init (void)
+{
+    int status = pthread_key_create(&metricskey, metrics_release);
+    if (0 != status) {
+        // the blocks are not recycled, a new one is allocated for every thread
+        ERROR_LOG("pthread_key_create failed with %d {%s}", status, __func__);
+    }
+}
+
+
+/**
+ * Find the counter block of the calling thread: a block released by a thread over, or a new one pushed on the list
+ * @return the block (a shared spare one if the heap is exhausted, its concurrent updates may be lost)
+ */
+metrics_t * metrics_local (void)
+{
+    static metrics_t spare;
+    metrics_t * metrics;
+    bool expected;
+
+    for (metrics = atomic_load(&metricslist); NULL != metrics; metrics = metrics->next) {
+        expected = false;
+        if (atomic_compare_exchange_strong(&metrics->inuse, &expected, true)) {
+            break;
+        }
+    }
+
+    if (NULL == metrics) {
+        metrics = (metrics_t *) calloc(1, sizeof(metrics_t));
+        if (NULL == metrics) {
+            ERROR_LOG("metrics memory allocation {%s}", __func__);
+            threadmetrics = &spare;
+            return threadmetrics;
+        }
+        atomic_init(&metrics->inuse, true);
+
+        metrics->next = atomic_load(&metricslist);
+        while (!atomic_compare_exchange_weak(&metricslist, &metrics->next, metrics));
+    }
+
+    pthread_setspecific(metricskey, metrics);
+    threadmetrics = metrics;
+    return threadmetrics;
+}
+
+
+/**
+ * @return the monotonic clock in ns, to time the waits
+ */
+uint64_t metrics_clock (void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+/**
+ * fdatasync() timed into the latency histogram
+ * @return the fdatasync() result
+ */
+int metrics_fdatasync (int fd)
+{
+    uint64_t start = metrics_clock ();
+    int rc = fdatasync(fd);
+    uint64_t elapsed = metrics_clock () - start;
+    unsigned int bucket = 0;
+
+    while ((bucket < METRICS_FSYNCBUCKETS - 1) && ((1ULL << bucket) * 1000 <= elapsed)) {
+        bucket++;
+    }
+
+    METRIC_ADD(METRIC_FSYNCS, 1);
+    METRIC_ADD(METRIC_FSYNCTIME, elapsed);
+    atomic_store_explicit(&threadmetrics->fsynchist[bucket],
+        atomic_load_explicit(&threadmetrics->fsynchist[bucket], memory_order_relaxed) + 1, memory_order_relaxed);
+
+    return rc;
+}
+
+
+// Exported name (Prometheus text format) of each counter, the ns ones are exported in seconds
+static const struct {
+    const char * name;
+    const char * help;
+    bool ns;
+} metrics_names[METRIC_COUNTERS] = {
+    [METRIC_ACCEPTED]    = { "aesdsocket_connections_accepted_total", "Connections accepted", false },
+    [METRIC_CLOSED]      = { "aesdsocket_connections_closed_total", "Connections closed", false },
+    [METRIC_BATCHES]     = { "aesdsocket_batches_total", "Batches of complete packets stored, one reply each", false },
+    [METRIC_BYTESIN]     = { "aesdsocket_received_bytes_total", "Bytes received from the clients", false },
+    [METRIC_BYTESOUT]    = { "aesdsocket_sent_bytes_total", "Bytes sent back to the clients", false },
+    [METRIC_REPLAYBYTES] = { "aesdsocket_replayed_bytes_total", "Storage content read back for the replies", false },
+    [METRIC_MUTEXWAIT]   = { "aesdsocket_mutex_wait_seconds_total", "Time spent waiting for the char device mutex", true },
+    [METRIC_COMMITWAIT]  = { "aesdsocket_commit_wait_seconds_total", "Time spent waiting for the previous records to be committed", true },
+    [METRIC_REALLOCS]    = { "aesdsocket_buffer_reallocations_total", "Reception and reply buffers grown", false },
+    [METRIC_FSYNCS]      = { NULL, NULL, false },     // exported with the histogram
+    [METRIC_FSYNCTIME]   = { NULL, NULL, true },
+    [METRIC_OVERSIZED]   = { "aesdsocket_oversized_packets_total", "Connections closed for a packet longer than the limit", false },
+    [METRIC_PAUSES]      = { "aesdsocket_backpressure_pauses_total", "Connections not read until their queued replies are sent", false },
+    [METRIC_THROTTLES]   = { "aesdsocket_throttles_total", "Connections delayed by their rate limit", false },
+};
+
+
+/**
+ * Write the sum of every thread counters, in the Prometheus text format
+ */
+void metrics_dump (FILE * out)
+{
+    uint64_t counters[METRIC_COUNTERS] = { 0 };
+    uint64_t fsynchist[METRICS_FSYNCBUCKETS] = { 0 };
+    uint64_t cumulated = 0;
+    unsigned int threads = 0;
+
+    for (metrics_t * metrics = atomic_load(&metricslist); NULL != metrics; metrics = metrics->next) {
+        for (unsigned int i = 0; i < METRIC_COUNTERS; i++) {
+            counters[i] += atomic_load_explicit(&metrics->counters[i], memory_order_relaxed);
+        }
+        for (unsigned int i = 0; i < METRICS_FSYNCBUCKETS; i++) {
+            fsynchist[i] += atomic_load_explicit(&metrics->fsynchist[i], memory_order_relaxed);
+        }
+        threads += atomic_load(&metrics->inuse) ? 1 : 0;
+    }
+
+    for (unsigned int i = 0; i < METRIC_COUNTERS; i++) {
+        if (NULL == metrics_names[i].name) {
+            continue;
+        }
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", metrics_names[i].name, metrics_names[i].help, metrics_names[i].name);
+        if (metrics_names[i].ns) {
+            fprintf(out, "%s %.9f\n", metrics_names[i].name, counters[i] / 1e9);
+        }
+        else {
+            fprintf(out, "%s %llu\n", metrics_names[i].name, (unsigned long long) counters[i]);
+        }
+    }
+
+    fprintf(out, "# HELP aesdsocket_fsync_seconds fdatasync() latency of the tmp file\n# TYPE aesdsocket_fsync_seconds histogram\n");
+    for (unsigned int i = 0; i < METRICS_FSYNCBUCKETS - 1; i++) {
+        cumulated += fsynchist[i];
+        fprintf(out, "aesdsocket_fsync_seconds_bucket{le=\"%g\"} %llu\n", (1ULL << i) / 1e6, (unsigned long long) cumulated);
+    }
+    fprintf(out, "aesdsocket_fsync_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long) counters[METRIC_FSYNCS]);
+    fprintf(out, "aesdsocket_fsync_seconds_sum %.9f\n", counters[METRIC_FSYNCTIME] / 1e9);
+    fprintf(out, "aesdsocket_fsync_seconds_count %llu\n", (unsigned long long) counters[METRIC_FSYNCS]);
+
+    fprintf(out, "# HELP aesdsocket_buffer_pool_total Reception buffers served by the pool (hit) or by the heap (miss)\n");
+    fprintf(out, "# TYPE aesdsocket_buffer_pool_total counter\n");
+    fprintf(out, "aesdsocket_buffer_pool_total{result=\"hit\"} %lu\n", atomic_load(&bufpool.hits));
+    fprintf(out, "aesdsocket_buffer_pool_total{result=\"miss\"} %lu\n", atomic_load(&bufpool.misses));
+
+    fprintf(out, "# HELP aesdsocket_threads Threads owning a counter block\n# TYPE aesdsocket_threads gauge\n");
+    fprintf(out, "aesdsocket_threads %u\n", threads);
+}
+
+
+/**
+ * Free the counter blocks, every thread must be over
+ */
+void metrics_destroy (void)
+{
+    metrics_t * metrics;
+
+    while (NULL != (metrics = atomic_load(&metricslist))) {
+        atomic_store(&metricslist, metrics->next);
+        free(metrics);
+    }
+    threadmetrics = NULL;
+    pthread_key_delete(metricskey);
+}
+
+
+int main (int argc, char** argv)
+{
+    int success = EXIT_SUCCESS;
+    int status;
+
+    int opt;
+    char * endpt;
+
+    // [0] Buffer pool and metrics, ready before anything can go wrong (the connection registries come with the listeners)
+    bufpool_init (&bufpool);
+    metrics_init ();
+
+    storage_t storage = { .name = "", .path = TMPFILE, .fd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER, .syncmutex = PTHREAD_MUTEX_INITIALIZER,
+                          .pendingcond = PTHREAD_COND_INITIALIZER, .durablecond = PTHREAD_COND_INITIALIZER,
+                          .committedcond = PTHREAD_COND_INITIALIZER };
+
+    eventloop_t * loops = NULL;
+    unsigned int loopnumber = 0;
+    workpool_t workpool;
+    workpool_t * pool = NULL;
+    listener_t * listeners = NULL;
+    unsigned int listenernumber = 0;
+    metricsendpoint_t metrics = { .pthread = 0, .sockfd = -1, .path = NULL };
+    metricsendpoint_t * endpoint = NULL;
+
+    // Command line options
+    while (-1 != (opt = getopt(argc, argv, "de:w:r:cs:pm:l:o:t:f:g:b:q:k:"))) {
+        switch (opt) {
+            case 'd':
+                config.daemon = true;
+                break;
+            case 'e':
+                config.eventloops = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                config.workers = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                config.listeners = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                config.cursor = true;
+                break;
+            case 's':
+                if (0 == strcmp(optarg, "always")) {
+                    config.syncpolicy = SYNC_ALWAYS;
+                }
+                else if (0 == strcmp(optarg, "none")) {
+                    config.syncpolicy = SYNC_NONE;
+                }
+                else if ((0 == strncmp(optarg, "batch", 5)) && (('\0' == optarg[5]) || (':' == optarg[5]))) {
+                    config.syncpolicy = SYNC_BATCH;
+                    if (':' == optarg[5]) {
+                        config.syncdelay = strtoul(optarg + 6, NULL, 10);
+                    }
+                }
+                else {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                config.persistent = true;
+                break;
+            case 'm':
+                config.metrics = optarg;
+                break;
+            case 't':
+                config.timestamp = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                config.timeformat = optarg;
+                break;
+            case 'g':
+                config.drain = strtoul(optarg, NULL, 10);
+                break;
+            case 'b':
+                config.maxpacket = strtoul(optarg, NULL, 10);
+                break;
+            case 'q':
+                config.highwater = strtoul(optarg, &endpt, 10);
+                config.lowwater = (':' == *endpt) ? strtoul(endpt + 1, NULL, 10) : config.highwater / 2;
+                if (config.lowwater > config.highwater) {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'k':
+                config.rate = strtoul(optarg, &endpt, 10);
+                config.burst = (':' == *endpt) ? strtoul(endpt + 1, NULL, 10) : config.rate;
+                if ((0 < config.rate) && (0 == config.burst)) {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                if (0 == strcmp(optarg, "none")) {
+                    logger.base = LOGLEVEL_NONE;
+                }
+                else if (0 == strcmp(optarg, "error")) {
+                    logger.base = LOGLEVEL_ERROR;
+                }
+                else if (0 == strcmp(optarg, "debug")) {
+                    logger.base = LOGLEVEL_DEBUG;
+                }
+                else {
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                atomic_store(&logger.level, logger.base);
+                break;
+            case 'o':
+                if (0 == strcmp(optarg, "stdout")) {
+                    logger.sink = LOGSINK_STDOUT;
+                }
+                else if (0 == strcmp(optarg, "syslog")) {
+                    logger.sink = LOGSINK_SYSLOG;
+                }
+                else {
+                    logger.sink = LOGSINK_FILE;
+                    logger.path = optarg;
+                }
+                break;
+            default:
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    // [1] Things to free or close are numbered with '[]'
+    openlog (NULL, 0, LOG_USER);
+
+    // Signal management
+    struct sigaction new_action;
+    memset(&new_action, 0, sizeof(struct sigaction));
+    new_action.sa_handler=signal_handler;
+    if( sigaction(SIGTERM, &new_action, NULL) != 0 ) {
+        ERROR_LOG("errno %d (%s) registering for SIGTERM {%s}",errno,strerror(errno), __func__);
+        END (EXIT_FAILURE);
+    }
+    if( sigaction(SIGINT, &new_action, NULL) ) {
+        ERROR_LOG("errno %d (%s) registering for SIGINT {%s}",errno,strerror(errno), __func__);
+        END (EXIT_FAILURE);
+    }
+    // Toggling the log level must not interrupt anything, and SA_RESTART doesn't restart poll(), epoll_wait() or the
+    // sleeps: SIGUSR1 is blocked before any thread starts (they all inherit it) and only taken by the level thread
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGUSR1);
+    if( 0 != pthread_sigmask(SIG_BLOCK, &sigset, NULL) ) {
+        ERROR_LOG("blocking SIGUSR1 {%s}", __func__);
+        END (EXIT_FAILURE);
+    }
+
+    // A client closing early must not kill us while sendfile() or splice() feed its socket
+    new_action.sa_handler=SIG_IGN;
+    if( sigaction(SIGPIPE, &new_action, NULL) ) {
+        ERROR_LOG("errno %d (%s) ignoring SIGPIPE {%s}",errno,strerror(errno), __func__);
+        END (EXIT_FAILURE);
+    }
+
+
+    // [2] Socket preparation
+    struct addrinfo *servinfo = NULL;
+    int sockfd = -1;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    status = getaddrinfo (NULL, SOCKPORT, &hints, &servinfo);
+    if (0 != status) {
+        ERROR_LOG("getaddrinfo(): %s {%s}", gai_strerror(status), __func__);
+        END (EXIT_FAILURE);
+    }
+
+    // [3]
+    sockfd = open_listener (servinfo);
+    if (-1 == sockfd) {
+        END (EXIT_FAILURE);
+    }
+
+
+
+    // Daemon creation if requested
+    pid_t pid;
+    if (config.daemon) {
+        // Daemon option required
+        pid = fork ();
+        if (-1 == pid) {
+            ERROR_LOG("errno %d (%s) forking for daemon {%s}",errno,strerror(errno), __func__);
+            END (EXIT_FAILURE);
+        }
+        else if (0 != pid) { // Parent has to quit
+            // watchout DO NOT cleanup
+            exit(EXIT_SUCCESS);
+        }
+
+        // Child reset
+        // create new session and process group
+        if (-1 == setsid ()) {
+            ERROR_LOG("errno %d (%s) creating daemon session & process group {%s}",errno,strerror(errno), __func__);
+            END (EXIT_FAILURE);
+        }
+
+        // set the working directory to the root directory
+        if (-1 == chdir ("/")) {
+            ERROR_LOG("errno %d (%s) setting daemon root directory {%s}",errno,strerror(errno), __func__);
+            END (EXIT_FAILURE);
+        }
+
+        // close all open files--NR_OPEN is overkill, but works
+        close(STDIN_FILENO);
+        close(STDOUT_FILENO);
+        close(STDERR_FILENO);
+
+        // redirect fd's 0,1,2 to /dev/null
+        open ("/dev/null", O_RDWR);   // stdin
+        open ("/dev/null", O_RDWR);   // stdout
+        open ("/dev/null", O_RDWR);   // stderr
+    }
+
+    // [9] Asynchronous logging, the thread starts once forked
+    if (0 != start_logger ()) {
+        END (EXIT_FAILURE);
+    }
+
+    // [4] messaging file storage creation
+#if USE_AESD_CHAR_DEVICE
+    if (config.cursor) {
+        // the driver drops the oldest writes, offsets of the device content are not stable
+        syslog (LOG_WARNING, "cursor mode not supported by %s, the whole content is replayed", TMPFILE);
+        config.cursor = false;
+    }
+#endif
+    if (0 != storage_open (&storage)) {
+        END (EXIT_FAILURE);
+    }
+    // the default stream of the connections not selecting any
+    streams_init (&storage);
+
+
+    // [5] Threads, buffers, and descriptors are acquired from the registry of the listener accepting the connection
+    // The storage address will be passed to everybody
+    // The registries keep the live handlers reachable for further cleanup
+
+
+    // [6] Event loops sharing the client sockets when requested (the acceptor stays in this thread)
+    if (0 < config.eventloops) {
+        loops = (eventloop_t *) malloc(config.eventloops * sizeof (eventloop_t));
+        if (NULL == loops) {
+            ERROR_LOG("eventloop_t table memory allocation {%s}", __func__);
+            END (EXIT_FAILURE);
+        }
+
+        for (loopnumber = 0; loopnumber < config.eventloops; loopnumber++) {
+            status = start_eventloop (&loops[loopnumber]);
+            if (0 != status) {
+                ERROR_LOG("start of event loop #%u {%s}", loopnumber, __func__);
+                END (EXIT_FAILURE);
+            }
+        }
+
+        // the group commit releases the replies held by the loops
+        streams_notify_loops (loops, loopnumber);
+
+        if (0 < config.workers) {
+            syslog (LOG_WARNING, "worker pool ignored, the connections are served by the event loops");
+        }
+    }
+    else if (0 < config.workers) {
+        // or a pool of pre-spawned workers (the acceptor stays in this thread)
+        pool = &workpool;
+        if (0 != start_workers (pool, config.workers)) {
+            END (EXIT_FAILURE);
+        }
+    }
+
+
+    // [7] Extra listeners sharing the port, each with its own accept loop thread
+    listenernumber = (1 < config.listeners) ? config.listeners : 1;
+    listeners = (listener_t *) calloc(listenernumber, sizeof (listener_t));
+    if (NULL == listeners) {
+        ERROR_LOG("listener_t table memory allocation {%s}", __func__);
+        END (EXIT_FAILURE);
+    }
+
+    for (unsigned int i = 0; i < listenernumber; i++) {
+        listeners[i].sockfd = -1;
+        listeners[i].timerfd = -1;
+        listeners[i].id = i;
+        atomic_init(&listeners[i].closing, false);
+        registry_init (&listeners[i].registry);
+        listeners[i].storage = &storage;
+        listeners[i].loops = loops;
+        listeners[i].loopcount = loopnumber;
+        listeners[i].pool = pool;
+    }
+    listeners[0].sockfd = sockfd;
+
+    // the timestamps are appended by the first accept loop, between two connections
+    if (0 < config.timestamp) {
+        listeners[0].timerfd = timestamp_open ();
+        if (-1 == listeners[0].timerfd) {
+            END (EXIT_FAILURE);
+        }
+    }
+
+    for (unsigned int i = 1; i < listenernumber; i++) {
+        listeners[i].sockfd = open_listener (servinfo);
+        if (-1 == listeners[i].sockfd) {
+            END (EXIT_FAILURE);
+        }
+
+        status = pthread_create (&listeners[i].pthread, NULL, acceptor_thread, (void *) &listeners[i]);
+        if (0 != status) {
+            ERROR_LOG("creation of acceptor thread #%u code %d {%s}", i, status, __func__);
+            listeners[i].pthread = 0;
+            END (EXIT_FAILURE);
+        }
+    }
+
+
+    // [8] Metrics endpoint when requested
+    if (NULL != config.metrics) {
+        endpoint = &metrics;
+        if (0 != start_metrics (endpoint, config.metrics)) {
+            END (EXIT_FAILURE);
+        }
+    }
+
+
+    // [5'] Accept continuously new connections from the first listener in this thread
+    END (accept_connections (&listeners[0]));
+
+
+    // Exit cleanup management
+    end:
+    if (0 != signal_caught) {
+        DEBUG_LOG("SIGNAL! SIGNAL! SIGNAL! %s {%s}", strsignal (signal_caught), __func__);
+    }
+    DEBUG_LOG("GOODBYE :)");
+
+    // [8]
+    if (NULL != endpoint) {
+        stop_metrics (endpoint);
+        endpoint = NULL;
+    }
+
+    // [7] (the first listener socket is closed with [3], the table is freed with the registries in [0])
+    if (NULL != listeners) {
+        stop_listeners (listeners, listenernumber);
+
+        if (-1 != listeners[0].timerfd) {
+            close(listeners[0].timerfd);
+            listeners[0].timerfd = -1;
+        }
+    }
+
+    // [5''] Drain on a signal: nothing is accepted anymore, the connections finish their batch in flight
+    // until the deadline, the ones left are cancelled with the registries
+    if (signal_to_get_out && (0 < config.drain) && (NULL != listeners)) {
+        if (-1 != sockfd) {
+            shutdown(sockfd, SHUT_RDWR);
+        }
+
+        struct timespec drainstart;
+        struct timespec drainend;
+        struct timespec timeout;
+        unsigned int left = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &drainstart);
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_sec += config.drain / 1000;
+        timeout.tv_nsec += (config.drain % 1000) * 1000000L;
+        if (timeout.tv_nsec >= 1000000000L) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000L;
+        }
+
+        // every connection set is shut down before waiting, they drain together
+        for (unsigned int i = 0; i < listenernumber; i++) {
+            registry_drain_start (&listeners[i].registry);
+        }
+        for (unsigned int i = 0; i < listenernumber; i++) {
+            left += registry_drain_wait (&listeners[i].registry, &timeout);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &drainend);
+
+        syslog (LOG_INFO, "Connections drained in %ld ms, %u left to cancel",
+                (drainend.tv_sec - drainstart.tv_sec) * 1000 + (drainend.tv_nsec - drainstart.tv_nsec) / 1000000, left);
+    }
+
+    // [6]
+    if (NULL != loops) {
+        streams_notify_loops (NULL, 0);
+        stop_eventloops(loops, loopnumber);
+
+        DEBUG_LOG("FREE loops {%s}", __func__);
+        free(loops);
+        loops = NULL;
+    }
+
+    if (NULL != pool) {
+        stop_workers (pool);
+        pool = NULL;
+    }
+
+    // [5] (the handler of a connection not accepted yet is live as well)
+    for (unsigned int i = 0; (NULL != listeners) && (i < listenernumber); i++) {
+        clean_handlers (&listeners[i].registry);
+    }
+
+    // [4] (the named streams as well), a hole left in a stream is an error
+    for (unsigned int i = 0; i < streams.count; i++) {
+        if (-1 != atomic_load(&streams.table[i]->holestart)) {
+            success = EXIT_FAILURE;
+        }
+    }
+    streams_close ();
+    storage_close (&storage);
+
+    // [9] (every other thread is over)
+    stop_logger ();
+
+    // [3]
+    if (-1 != sockfd) {
+        DEBUG_LOG("SHUTDOWN socketfd {%s}", __func__);
+        shutdown(sockfd, SHUT_RDWR);
+        //close (sockfd);
+    }
+
+    // [2]
+    if (NULL != servinfo) {
+        DEBUG_LOG("FREE service info {%s}", __func__);
+        freeaddrinfo (servinfo);
+    }
+
+    // [1]
+    DEBUG_LOG("CLOSE syslog {%s}", __func__);
+    closelog();
+
+    // [0]
+    if (NULL != listeners) {
+        for (unsigned int i = 0; i < listenernumber; i++) {
+            registry_destroy (&listeners[i].registry);
+        }
+
+        DEBUG_LOG("FREE listeners {%s}", __func__);
+        free(listeners);
+        listeners = NULL;
+    }
+    bufpool_destroy (&bufpool);
+    metrics_destroy ();
+
+    DEBUG_LOG("success = %d {%s}", success, __func__);
+    exit (success);
+}
+
+
+
+/**
+ * Make room in the reception buffer of a handler. It starts as a pool buffer and grows geometrically when full
+ * @return 0 on success, -1 on error
+ */
+int rxbuffer_reserve (handlers_t * hdl)
+{
+    if (hdl->bufflen < hdl->buffsize) {
+        return 0;
+    }
+
+    // full of a single incomplete packet (the complete ones are consumed), rxbuffer_batch() keeps it under -b
+    if (0 != bufpool_grow (&bufpool, &hdl->buffpt, &hdl->buffsize, hdl->bufflen)) {
+        ERROR_LOG("buffer reallocation failed {%s}", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Charge the packets of a batch to the token bucket of the connection (-k): the batch is already received, it's
+ * processed anyway and the connection pays back the debt by not being read for a while
+ * @return the ns to wait before reading the connection again, 0 if it respects its rate
+ */
+uint64_t ratelimit_charge (handlers_t * hdl, const char * batch, size_t len)
+{
+    const char * charpt = batch;
+    unsigned int packets = 0;
+    uint64_t now;
+
+    if (0 == config.rate) {
+        return 0;
+    }
+
+    while (NULL != (charpt = memchr(charpt, '\n', batch + len - charpt))) {
+        packets++;
+        charpt++;
+    }
+
+    now = metrics_clock ();
+    hdl->tokens += (double) (now - hdl->refilled) * config.rate / 1e9;
+    if (hdl->tokens > config.burst) {
+        hdl->tokens = config.burst;
+    }
+    hdl->refilled = now;
+
+    hdl->tokens -= packets;
+    if (0 <= hdl->tokens) {
+        return 0;
+    }
+
+    METRIC_ADD(METRIC_THROTTLES, 1);
+    return (uint64_t) (-hdl->tokens * 1e9 / config.rate);
+}
+
+
+/**
+ * Find the batch of complete packets at the beginning of the reception buffer.
+ * Only the bytes not searched yet are scanned: backwards for the last '\n', or forwards packet by packet when
+ * their length is bounded (-b), the incomplete packet left at the end included
+ * @param towrite set to the batch length (last '\n' included), 0 if no packet is complete
+ * @return 0 on success, -1 if a packet is longer than the limit
+ */
+int rxbuffer_batch (handlers_t * hdl, size_t * towrite)
+{
+    char * charpt; // will be a pointer on the last '\n' character position
+    char * packet; // beginning of the packet scanned, the bytes searched before hold no '\n'
+    char * end = hdl->buffpt + hdl->bufflen;
+
+    *towrite = 0;
+    if (0 == config.maxpacket) {
+        charpt = memrchr(hdl->buffpt + hdl->scanned, '\n', hdl->bufflen - hdl->scanned);
+        hdl->scanned = hdl->bufflen;
+        if (NULL != charpt) {
+            *towrite = charpt - hdl->buffpt + 1;
+        }
+        return 0;
+    }
+
+    packet = hdl->buffpt;
+    charpt = hdl->buffpt + hdl->scanned;
+    hdl->scanned = hdl->bufflen;
+    while (NULL != (charpt = memchr(charpt, '\n', end - charpt))) {
+        charpt++;
+        if ((size_t) (charpt - packet) > config.maxpacket) {
+            break;
+        }
+        packet = charpt;
+    }
+
+    // a packet is at most -b bytes, '\n' included: the incomplete one can't be that long without it
+    if ((NULL != charpt) || ((size_t) (end - packet) >= config.maxpacket)) {
+        ERROR_LOG("packet longer than %zu bytes from %s, closing {%s}", config.maxpacket, hdl->clentaddr, __func__);
+        METRIC_ADD(METRIC_OVERSIZED, 1);
+        return -1;
+    }
+
+    *towrite = packet - hdl->buffpt;
+    return 0;
+}
+
+
+/**
+ * Drop the consumed bytes of the processed batch, keeping the beginning of the next packet.
+ * A buffer grown by a large packet is kept for the next ones (-b bounds it), it's freed with the connection
+ */
+void rxbuffer_consume (handlers_t * hdl, size_t consumed)
+{
+    if (0 == consumed) {
+        return;
+    }
+
+    hdl->bufflen -= consumed;
+    hdl->scanned -= consumed;
+    memmove(hdl->buffpt, hdl->buffpt + consumed, hdl->bufflen);
+}
+
+
+
+/**
+ * Serve a connection until the client leaves or an error occurs (blocking socket)
+ */
+void serve_connection (handlers_t * hdl)
+{
+    int ret;
+
+    ssize_t count;
+    size_t towrite;
+    uint64_t throttle;
+    struct timespec delay;
+
+    reply_t * reply;
+
+#ifdef USE_IO_URING
+    if (0 == uring_serve_connection (hdl)) {
+        return;
+    }
+    // io_uring not usable, back to the system calls
+#endif
+
+    syslog (LOG_DEBUG, "Accepted connection from %s", hdl->clentaddr);
+
+    // A single reply, with its buffer, serves every batch: left in the free list, it's freed with the handler
+    reply = hdl->replyfree;
+    if (NULL == reply) {
+        reply = (reply_t *) malloc(sizeof(reply_t));
+        if (NULL == reply) {
+            ERROR_LOG("reply memory allocation {%s}", __func__);
+            return;
+        }
+        reply->buffpt = NULL;
+        reply->buffsize = 0;
+        reply->next = NULL;
+        hdl->replyfree = reply;
+    }
+
+    // Loop reception, the complete packets received together are written to the tmp file and answered at once
+    while ( !signal_to_get_out ) {
+        if (-1 == rxbuffer_reserve (hdl)) {
+            return;
+        }
+
+        // Reception (blocking) of whatever fits in the buffer
+        count = recv(hdl->clientfd, hdl->buffpt + hdl->bufflen, hdl->buffsize - hdl->bufflen, 0);
+        if (-1 == count) {
+            if(EINTR == errno){
+                DEBUG_LOG("errno %d (%s) catch of EINTR in recv() {%s}", errno, strerror(errno), __func__);
+                return;
+            }
+            if(signal_to_get_out){
+                DEBUG_LOG("errno %d (%s) catch of EINTR in recv() [I treated it] {%s}", errno, strerror(errno), __func__);
+                return;
+            }
+            ERROR_LOG("errno %d (%s) recv() {%s}", errno, strerror(errno), __func__);
+            return;
+        }
+        else if (0 == count) {
+            // client disconnected (or the drain shut the reception down), let's terminate
+            DEBUG_LOG("client disconnected (descriptor %d) {%s}", hdl->clientfd, __func__);
+            return;
+        }
+
+        hdl->bufflen += count;
+        METRIC_ADD(METRIC_BYTESIN, count);
+
+        // Store the batch and send back the resulting content
+        if ((-1 == rxbuffer_batch (hdl, &towrite)) || (-1 == stream_select (hdl, &towrite))) {
+            return;
+        }
+        if (0 != towrite) {
+            ret = process_batch (hdl, hdl->buffpt, towrite, reply);
+            if (0 != ret) {
+                return;
+            }
+
+            ret = send_reply (hdl, reply);
+            if (0 != ret) {
+                return;
+            }
+
+            // over its rate, the connection isn't read for a while
+            throttle = ratelimit_charge (hdl, hdl->buffpt, towrite);
+            if (0 != throttle) {
+                delay.tv_sec = throttle / 1000000000ULL;
+                delay.tv_nsec = throttle % 1000000000ULL;
+                nanosleep(&delay, NULL);
+            }
+        }
+        rxbuffer_consume (hdl, towrite);
+    }
+}
+
+
+void * server_client_app (void * handler /*int friendfd, char * client_addr, int tmpfd, pthread_mutex_t * pmutex*/)
+{
+    handlers_t * hdl = (handlers_t *)handler;
+
+    serve_connection (hdl);
+
+    release_handler (hdl);
+
+    syslog (LOG_DEBUG, "Closed connection from %s", hdl->clentaddr);
+
+    // last access to the handler, the acceptor will join this thread and recycle it
+    registry_retire (hdl->registry, hdl);
+    return NULL;
+}
+
+
+
+#if USE_AESD_CHAR_DEVICE
+/**
+ * Write the whole vector to the descriptor, managing potential incomplete writes
+ * @return 0 on success, -1 on error (EINTR included as it means we are asked to quit)
+ */
+static int writev_all (int fd, struct iovec * iov, int iovcnt)
+{
+    ssize_t count;
+
+    while (iovcnt > 0) {
+        count = writev (fd, iov, iovcnt);
+        if (-1 == count) {
+            if (EINTR == errno) {
+                DEBUG_LOG("errno %d (%s) catch of EINTR in writev() {%s}", errno, strerror(errno), __func__);
+                return -1;
+            }
+            ERROR_LOG("errno %d (%s) writev() {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+
+        // skip what has been written
+        while ((iovcnt > 0) && ((size_t) count >= iov->iov_len)) {
+            count -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + count;
+            iov->iov_len -= count;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Tell if a packet is a seek command for the driver rather than data to store (the packet isn't NUL terminated)
+ */
+static bool is_seek_command (const char * packet, size_t len)
+{
+    return (len > strlen(AESDCHAR_SEEK_CMD)) && (0 == strncmp(packet, AESDCHAR_SEEK_CMD, strlen(AESDCHAR_SEEK_CMD)));
+}
+
+
+/**
+ * Write data packets (no seek command among them).
+ * Each packet is an iovec of its own: the driver gets one write per packet and keeps storing one entry each
+ * @return 0 on success, -1 on error
+ */
+static int write_packets (int fd, const char * batch, size_t len)
+{
+    struct iovec iov[WRITEV_MAXPACKETS];
+    int iovcnt = 0;
+    const char * packet = batch;
+    const char * charpt;
+
+    while (packet < batch + len) {
+        // the batch only holds complete packets
+        charpt = memchr(packet, '\n', batch + len - packet);
+
+        iov[iovcnt].iov_base = (void *) packet;
+        iov[iovcnt].iov_len = charpt - packet + 1;
+        iovcnt++;
+        packet = charpt + 1;
+
+        if ((WRITEV_MAXPACKETS == iovcnt) || (packet == batch + len)) {
+            DEBUG_LOG("writev %d packets {%s}", iovcnt, __func__);
+            if (0 != writev_all (fd, iov, iovcnt)) {
+                return -1;
+            }
+            iovcnt = 0;
+        }
+    }
+
+    return 0;
+}
+
+
+/**
+ * Read the descriptor until its end into the reply buffer, kept from the previous replies and grown when full
+ * @return 0 on success, -1 on error
+ */
+static int read_all (int fd, reply_t * reply)
+{
+    ssize_t count;
+
+    do {
+        if ((size_t) reply->end == reply->buffsize) {
+            if (0 != bufpool_grow (&bufpool, &reply->buffpt, &reply->buffsize, reply->end)) {
+                ERROR_LOG("reply buffer reallocation failed {%s}", __func__);
+                return -1;
+            }
+        }
+
+        count = read (fd, reply->buffpt + reply->end, reply->buffsize - reply->end);
+        if (-1 == count) {
+            ERROR_LOG("errno %d (%s) read() {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+        reply->end += count;
+    }
+    while (0 != count);
+
+    return 0;
+}
+
+
+/**
+ * Move the descriptor content into the connection pipe, without any copy to user space.
+ * What doesn't fit in the pipe (or everything when the driver can't splice) is read into reply->buffpt
+ * @return 0 on success, -1 on error
+ */
+static int splice_all (handlers_t * hdl, int fd, reply_t * reply)
+{
+    ssize_t count;
+
+    if (0 != reply->end) {
+        // the pipe is sent first, what follows content already read must be read as well
+        return read_all (fd, reply);
+    }
+
+    if (-1 == hdl->pipefd[0]) {
+        if (-1 == pipe2(hdl->pipefd, O_NONBLOCK)) {
+            DEBUG_LOG("errno %d (%s) pipe2(), falling back to read() {%s}", errno, strerror(errno), __func__);
+            hdl->pipefd[0] = -1;
+            hdl->pipefd[1] = -1;
+            return read_all (fd, reply);
+        }
+
+        // the default pipe only holds 64 KiB, when full (or not resized) the rest is read
+        fcntl(hdl->pipefd[1], F_SETPIPE_SZ, REPLY_PIPELEN);
+    }
+
+    while (true) {
+        count = splice(fd, NULL, hdl->pipefd[1], NULL, REPLY_PIPELEN, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (-1 == count) {
+            if (EAGAIN == errno) {
+                // the pipe is full (previous replies may not be sent yet)
+                break;
+            }
+            if ((EINVAL == errno) && (0 == reply->piped)) {
+                DEBUG_LOG("%s can't be spliced, falling back to read() {%s}", hdl->storage->path, __func__);
+                break;
+            }
+            ERROR_LOG("errno %d (%s) splice() {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+        else if (0 == count) {
+            return 0;
+        }
+
+        reply->piped += count;
+    }
+
+    return read_all (fd, reply);
+}
+#endif
+
+
+/**
+ * Open the storage (its mutexes and conditions are statically initialized): the tmp file is created empty, the char device
+ * is only opened when used. The group commit flusher is started when requested
+ * @return 0 on success, -1 on error
+ */
+int storage_open (storage_t * storage)
+{
+    atomic_init(&storage->tail, 0);
+    atomic_init(&storage->committed, 0);
+    atomic_init(&storage->commitwaiters, 0);
+    atomic_init(&storage->holestart, -1);
+    atomic_init(&storage->holeend, 0);
+
+#if !USE_AESD_CHAR_DEVICE
+    storage->fd = open (storage->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+    if (-1 == storage->fd) {
+        ERROR_LOG("errno %d (%s) opening the tmp file {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    atomic_init(&storage->durable, 0);
+    if (SYNC_BATCH == config.syncpolicy) {
+        int status = pthread_create (&storage->flusher, NULL, flusher_thread, (void *) storage);
+        if (0 != status) {
+            ERROR_LOG("creation of flusher thread code %d {%s}", status, __func__);
+            storage->flusher = 0;
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+
+/**
+ * Reserve the room of a record at the end of the tmp file by moving the tail forward atomically. The thread can't be
+ * cancelled until the record is committed: every record reserved after it would wait for it forever
+ * @param cancelstate the previous cancelability state, restored by storage_commit()
+ * @return the start offset of the record, to be committed once written
+ */
+off_t storage_reserve (storage_t * storage, size_t len, int * cancelstate)
+{
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, cancelstate);
+    return atomic_fetch_add(&storage->tail, (off_t) len);
+}
+
+
+/**
+ * Make a written record visible: records become visible in reservation order, so the file is complete up to its end
+ * @param cancelstate the cancelability state returned by storage_reserve()
+ */
+void storage_commit (storage_t * storage, off_t start, size_t len, int cancelstate)
+{
+    // Wait for the records reserved before this one, they are being written right now: a few yields cover the
+    // small records, the writers of the large ones are waited for asleep
+    if (start != atomic_load(&storage->committed)) {
+        uint64_t waitstart = metrics_clock ();
+        for (unsigned int spin = 0; (spin < COMMIT_SPINS) && (start != atomic_load(&storage->committed)); spin++) {
+            sched_yield();
+        }
+        if (start != atomic_load(&storage->committed)) {
+            pthread_mutex_lock(&storage->syncmutex);
+            atomic_fetch_add(&storage->commitwaiters, 1);
+            while (start != atomic_load(&storage->committed)) {
+                pthread_cond_wait(&storage->committedcond, &storage->syncmutex);
+            }
+            atomic_fetch_sub(&storage->commitwaiters, 1);
+            pthread_mutex_unlock(&storage->syncmutex);
+        }
+        METRIC_ADD(METRIC_COMMITWAIT, metrics_clock () - waitstart);
+    }
+    atomic_store(&storage->committed, start + (off_t) len);
+
+    // the waiters count is read after committed is stored, a writer going to sleep either sees the new value or is woken
+    if ((0 != storage->flusher) || (0 != atomic_load(&storage->commitwaiters))) {
+        pthread_mutex_lock(&storage->syncmutex);
+        if (0 != storage->flusher) {
+            pthread_cond_signal(&storage->pendingcond);
+        }
+        pthread_cond_broadcast(&storage->committedcond);
+        pthread_mutex_unlock(&storage->syncmutex);
+    }
+
+    pthread_setcancelstate(cancelstate, NULL);
+}
+
+
+/**
+ * Record a reserved range which couldn't be written, before it's committed: it reads as zeros, which were never
+ * received nor acknowledged. No reply covering it is sent anymore, and the server is stopped (as by SIGTERM)
+ */
+void storage_hole (storage_t * storage, off_t start, size_t len)
+{
+    off_t holestart;
+
+    pthread_mutex_lock(&storage->syncmutex);
+    // the end first: a reader seeing the new start sees an end covering it
+    if (atomic_load(&storage->holeend) < start + (off_t) len) {
+        atomic_store(&storage->holeend, start + (off_t) len);
+    }
+    holestart = atomic_load(&storage->holestart);
+    if ((-1 == holestart) || (start < holestart)) {
+        atomic_store(&storage->holestart, start);
+    }
+    pthread_mutex_unlock(&storage->syncmutex);
+
+    ERROR_LOG("%s has a hole of %zu bytes at %lld, stopping the server {%s}", storage->path, len, (long long) start, __func__);
+    // process directed, for the thread which doesn't block SIGTERM
+    kill(getpid(), SIGTERM);
+}
+
+
+/**
+ * Check a replay range against the holes, the range of a reply is always checked after its own commit
+ * @return true if the range can't be replayed
+ */
+bool storage_covers_hole (storage_t * storage, off_t pos, off_t end)
+{
+    off_t holestart = atomic_load(&storage->holestart);
+
+    return (-1 != holestart) && (pos < atomic_load(&storage->holeend)) && (end > holestart);
+}
+
+
+/**
+ * Append a record to the tmp file without any lock: the record room is reserved, then written with pwrite()
+ * (O_APPEND is not used as Linux pwrite() would ignore the offset), then committed
+ * @param end the end offset of the record in the file
+ * @return 0 on success, -1 on error (the room is committed anyway, it's recorded as a hole)
+ */
+int storage_append (storage_t * storage, const char * record, size_t len, off_t * end)
+{
+    int cancelstate;
+    off_t start = storage_reserve (storage, len, &cancelstate);
+    size_t written = 0;
+    ssize_t count;
+    int rc = 0;
+
+    while (written < len) {
+        count = pwrite (storage->fd, record + written, len - written, start + written);
+        if (-1 == count) {
+            if (EINTR == errno) {
+                continue;
+            }
+            ERROR_LOG("errno %d (%s) pwrite() {%s}", errno, strerror(errno), __func__);
+            rc = -1;
+            break;
+        }
+        written += count;
+    }
+
+    // the following records wait for this one, the room is committed anyway
+    if (0 != rc) {
+        storage_hole (storage, start, len);
+    }
+    storage_commit (storage, start, len, cancelstate);
+
+    *end = start + (off_t) len;
+    return rc;
+}
+
+
+static void unlock_mutex (void * mutex)
+{
+    pthread_mutex_unlock((pthread_mutex_t *) mutex);
+}
+
+
+/**
+ * Block until the group commit made the tmp file durable up to end
+ */
+void storage_wait_durable (storage_t * storage, off_t end)
+{
+    pthread_mutex_lock(&storage->syncmutex);
+    // the thread may be cancelled while waiting, the mutex must not stay locked
+    pthread_cleanup_push(unlock_mutex, &storage->syncmutex);
+
+    while (atomic_load(&storage->durable) < end) {
+        pthread_cond_wait(&storage->durablecond, &storage->syncmutex);
+    }
+
+    pthread_cleanup_pop(1);
+}
+
+
+/**
+ * Set the event loops to wake up when the group commit moves forward (NULL to stop before the loops are destroyed)
+ */
+void storage_notify_loops (storage_t * storage, eventloop_t * loops, unsigned int loopcount)
+{
+    pthread_mutex_lock(&storage->syncmutex);
+    storage->loops = loops;
+    storage->loopcount = loopcount;
+    pthread_mutex_unlock(&storage->syncmutex);
+}
+
+
+/**
+ * Group commit thread: waits for pending records, lets the batch grow for at most config.syncdelay ms (or
+ * SYNC_BATCHLEN bytes), covers the whole batch with a single fdatasync() and releases the waiting replies
+ */
+void * flusher_thread (void * arg)
+{
+    storage_t * storage = (storage_t *) arg;
+    struct timespec deadline;
+    uint64_t wakeup = 1;
+    sigset_t sigset;
+    off_t target;
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    pthread_mutex_lock(&storage->syncmutex);
+
+    while (true) {
+        while (!storage->closing && (atomic_load(&storage->committed) == atomic_load(&storage->durable))) {
+            pthread_cond_wait(&storage->pendingcond, &storage->syncmutex);
+        }
+
+        if (atomic_load(&storage->committed) == atomic_load(&storage->durable)) {
+            // closing with nothing left to flush
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += config.syncdelay / 1000;
+        deadline.tv_nsec += (config.syncdelay % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (!storage->closing && ((atomic_load(&storage->committed) - atomic_load(&storage->durable)) < SYNC_BATCHLEN)) {
+            if (ETIMEDOUT == pthread_cond_timedwait(&storage->pendingcond, &storage->syncmutex, &deadline)) {
+                break;
+            }
+        }
+
+        target = atomic_load(&storage->committed);
+        pthread_mutex_unlock(&storage->syncmutex);
+
+        if (-1 == metrics_fdatasync (storage->fd)) {
+            ERROR_LOG("errno %d (%s) fdatasync() {%s}", errno, strerror(errno), __func__);
+        }
+
+        pthread_mutex_lock(&storage->syncmutex);
+        atomic_store(&storage->durable, target);
+        pthread_cond_broadcast(&storage->durablecond);
+
+        for (unsigned int i = 0; i < storage->loopcount; i++) {
+            if (sizeof(uint64_t) != write(storage->loops[i].syncfd, &wakeup, sizeof(uint64_t))) {
+                ERROR_LOG("errno %d (%s) waking event loop #%u up {%s}", errno, strerror(errno), i, __func__);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&storage->syncmutex);
+    return NULL;
+}
+
+
+void storage_close (storage_t * storage)
+{
+    if (0 != storage->flusher) {
+        pthread_mutex_lock(&storage->syncmutex);
+        storage->closing = true;
+        pthread_cond_signal(&storage->pendingcond);
+        pthread_mutex_unlock(&storage->syncmutex);
+
+        DEBUG_LOG("JOINING flusher {%s}", __func__);
+        pthread_join(storage->flusher, NULL);
+        storage->flusher = 0;
+    }
+
+    if (-1 != storage->fd) {
+#if !USE_AESD_CHAR_DEVICE
+        // a single last sync covers whatever the policy left to the kernel
+        if (SYNC_NONE == config.syncpolicy) {
+            metrics_fdatasync (storage->fd);
+        }
+#endif
+        DEBUG_LOG("CLOSE tmp file {%s}", __func__);
+        close (storage->fd);
+        storage->fd = -1;
+    }
+
+    pthread_mutex_destroy(&storage->mutex);
+    pthread_mutex_destroy(&storage->syncmutex);
+    pthread_cond_destroy(&storage->pendingcond);
+    pthread_cond_destroy(&storage->durablecond);
+    pthread_cond_destroy(&storage->committedcond);
+}
+
+
+/**
+ * Register the default stream, opened by main, as the first one of the table
+ */
+void streams_init (storage_t * storage)
+{
+    streams.table[0] = storage;
+    streams.count = 1;
+}
+
+
+/**
+ * Find a stream by its name, or open it when it's the first connection selecting it
+ * @param name not NUL terminated, len bytes long (0 for the default stream)
+ * @return the stream storage, NULL if the name is invalid, the device node is missing or too many streams are open
+ */
+storage_t * streams_get (const char * name, size_t len)
+{
+    storage_t * storage = NULL;
+
+    if (STREAM_NAMELEN <= len) {
+        ERROR_LOG("stream name longer than %d bytes {%s}", STREAM_NAMELEN - 1, __func__);
+        return NULL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        // the name is part of a path
+        if (!isalnum((unsigned char) name[i]) && ('-' != name[i]) && ('_' != name[i])) {
+            ERROR_LOG("invalid stream name %.*s {%s}", (int) len, name, __func__);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&streams.mutex);
+
+    for (unsigned int i = 0; i < streams.count; i++) {
+        if ((len == strlen(streams.table[i]->name)) && (0 == strncmp(streams.table[i]->name, name, len))) {
+            storage = streams.table[i];
+            goto unlock;
+        }
+    }
+
+    if (STREAMS_MAX == streams.count) {
+        ERROR_LOG("%d streams already open, %.*s refused {%s}", STREAMS_MAX, (int) len, name, __func__);
+        goto unlock;
+    }
+
+    storage = (storage_t *) malloc(sizeof(storage_t));
+    if (NULL == storage) {
+        ERROR_LOG("storage_t memory allocation {%s}", __func__);
+        goto unlock;
+    }
+    *storage = (storage_t) { .fd = -1, .mutex = PTHREAD_MUTEX_INITIALIZER, .syncmutex = PTHREAD_MUTEX_INITIALIZER,
+                             .pendingcond = PTHREAD_COND_INITIALIZER, .durablecond = PTHREAD_COND_INITIALIZER,
+                             .committedcond = PTHREAD_COND_INITIALIZER };
+    memcpy(storage->name, name, len);
+    storage->name[len] = '\0';
+    snprintf(storage->path, sizeof(storage->path), "%s.%s", TMPFILE, storage->name);
+
+#if USE_AESD_CHAR_DEVICE
+    // the device instance is provided by the driver (streams module parameter), it's not created as a regular file
+    if (-1 == access(storage->path, R_OK | W_OK)) {
+        ERROR_LOG("errno %d (%s) stream device %s {%s}", errno, strerror(errno), storage->path, __func__);
+        free(storage);
+        storage = NULL;
+        goto unlock;
+    }
+#endif
+
+    if (0 != storage_open (storage)) {
+        storage_close (storage);
+        free(storage);
+        storage = NULL;
+        goto unlock;
+    }
+    storage_notify_loops (storage, streams.loops, streams.loopcount);
+
+    streams.table[streams.count++] = storage;
+    syslog (LOG_INFO, "Stream %s opened on %s", storage->name, storage->path);
+
+    unlock:
+    pthread_mutex_unlock(&streams.mutex);
+    return storage;
+}
+
+
+/**
+ * Set the event loops to wake up when the group commit of any stream moves forward (NULL to stop)
+ */
+void streams_notify_loops (eventloop_t * loops, unsigned int loopcount)
+{
+    pthread_mutex_lock(&streams.mutex);
+    streams.loops = loops;
+    streams.loopcount = loopcount;
+    for (unsigned int i = 0; i < streams.count; i++) {
+        storage_notify_loops (streams.table[i], loops, loopcount);
+    }
+    pthread_mutex_unlock(&streams.mutex);
+}
+
+
+/**
+ * Close the named streams once no connection uses them anymore, the default one is left to main
+ */
+void streams_close (void)
+{
+    pthread_mutex_lock(&streams.mutex);
+    while (1 < streams.count) {
+        streams.count--;
+        storage_close (streams.table[streams.count]);
+        free(streams.table[streams.count]);
+        streams.table[streams.count] = NULL;
+    }
+    pthread_mutex_unlock(&streams.mutex);
+}
+
+
+/**
+ * Switch the connection to the stream selected by its first packet, the selection packet is consumed
+ * (neither stored nor answered). Any other first packet leaves the connection on the default stream
+ * @param towrite the length of the batch of complete packets received, reduced by the selection packet
+ * @return 1 if the connection switched to another stream, 0 if it didn't, -1 to close the connection
+ */
+int stream_select (handlers_t * hdl, size_t * towrite)
+{
+    storage_t * storage;
+    size_t len;
+
+    if (hdl->selected || (0 == *towrite)) {
+        return 0;
+    }
+    hdl->selected = true;
+
+    len = (char *) memchr(hdl->buffpt, '\n', *towrite) - hdl->buffpt + 1;
+    if ((len <= strlen(STREAM_CMD)) || (0 != strncmp(hdl->buffpt, STREAM_CMD, strlen(STREAM_CMD)))) {
+        return 0;
+    }
+
+    storage = streams_get (hdl->buffpt + strlen(STREAM_CMD), len - strlen(STREAM_CMD) - 1);
+    if (NULL == storage) {
+        return -1;
+    }
+    DEBUG_LOG("%s selected stream %s {%s}", hdl->clentaddr, storage->path, __func__);
+
+    rxbuffer_consume (hdl, len);
+    *towrite -= len;
+
+    if (storage == hdl->storage) {
+        return 0;
+    }
+    hdl->storage = storage;
+    hdl->cursor = 0;
+    return 1;
+}
+
+
+#if USE_AESD_CHAR_DEVICE
+/**
+ * Write data packets to the char device, opened and closed around the write unless the connection keeps it (the
+ * storage mutex is held)
+ * @return 0 on success, -1 on error
+ */
+static int device_write (handlers_t * hdl, int * ptmpfd, const char * packets, size_t len)
+{
+    int ret;
+
+    if (!config.persistent) {
+        DEBUG_LOG("not ioctl open %s", hdl->storage->path);
+        *ptmpfd = open (hdl->storage->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+        if (-1 == *ptmpfd) {
+            ERROR_LOG("errno %d (%s) opening the tmp file {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+    }
+
+    ret = write_packets (*ptmpfd, packets, len);
+
+    if (!config.persistent) {
+        DEBUG_LOG("close %s", hdl->storage->path);
+        close (*ptmpfd);
+        *ptmpfd = -1;
+    }
+
+    return ret;
+}
+
+
+/**
+ * Read the char device content back into the reply, after the content already there (the storage mutex is held)
+ * @param seek the seek command to execute first, NULL to read everything (seeklen its length, '\n' included)
+ * @return 0 on success, -1 on error
+ */
+static int device_read_back (handlers_t * hdl, int * ptmpfd, const char * seek, size_t seeklen, reply_t * reply)
+{
+    int ret;
+
+    // open char device (or rewind the persistent one), seek if requested, and read back its content
+    if (!config.persistent) {
+        *ptmpfd = open (hdl->storage->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+        if (-1 == *ptmpfd) {
+            ERROR_LOG("errno %d (%s) opening the tmp file {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+    }
+    else if (-1 == lseek (*ptmpfd, 0, SEEK_SET)) {
+        // the driver moves the position forward on write and the ioctl seeks relatively to it
+        ERROR_LOG("errno %d (%s) lseek() START {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    if (NULL != seek) {
+        struct aesd_seekto seek_ioctl = {0, 0};
+
+        DEBUG_LOG("ioctl string: %.*s", (int) seeklen, seek);
+
+        sscanf(seek + strlen(AESDCHAR_SEEK_CMD), "%u,%u", &seek_ioctl.write_cmd, &seek_ioctl.write_cmd_offset);
+
+        DEBUG_LOG("ioctl cmd: %u, offset: %u", seek_ioctl.write_cmd, seek_ioctl.write_cmd_offset);
+
+        ioctl(*ptmpfd, AESDCHAR_IOCSEEKTO, &seek_ioctl);
+    }
+
+    ret = splice_all (hdl, *ptmpfd, reply);
+
+    if (!config.persistent) {
+        close (*ptmpfd);
+        *ptmpfd = -1;
+    }
+
+    return ret;
+}
+#endif
+
+
+/**
+ * Store a batch of complete packets (each ending by a '\n') and prepare the single reply holding the resulting content
+ * (char device: the content read back after each seek command of the batch, in order)
+ * @param hdl the connection handler, giving the storage
+ * @param batch the packets to store, len their total length
+ * @param reply filled with the content to send back, its buffer (if any) is reused
+ * @return 0 on success, -1 on error
+ */
+int process_batch (handlers_t * hdl, const char * batch, size_t len, reply_t * reply)
+{
+    reply->next = NULL;
+    reply->piped = 0;
+    reply->pos = 0;
+    reply->end = 0;
+    reply->syncend = 0;
+
+#if !USE_AESD_CHAR_DEVICE
+    off_t end;
+
+    // The packets are contiguous: the whole batch takes a single reservation and write
+    DEBUG_LOG("append %zu bytes to %s", len, hdl->storage->path);
+    if (0 != storage_append (hdl->storage, batch, len, &end)) {
+        return -1;
+    }
+
+    if (SYNC_ALWAYS == config.syncpolicy) {
+        metrics_fdatasync (hdl->storage->fd);
+    }
+    else if (SYNC_BATCH == config.syncpolicy) {
+        // the reply acknowledges the batch once the group commit covered it
+        if (NULL == hdl->loop) {
+            storage_wait_durable (hdl->storage, end);
+        }
+        else {
+            reply->syncend = end;
+        }
+    }
+
+    // The file is only appended: the content up to here stays valid to be replayed
+    // In cursor mode the client only gets what follows the previous reply
+    reply->pos = config.cursor ? hdl->cursor : 0;
+    reply->end = end;
+    hdl->cursor = reply->end;
+    if (storage_covers_hole (hdl->storage, reply->pos, reply->end)) {
+        ERROR_LOG("reply to %s would replay a hole of %s, closing {%s}", hdl->clentaddr, hdl->storage->path, __func__);
+        return -1;
+    }
+
+    METRIC_ADD(METRIC_BATCHES, 1);
+    METRIC_ADD(METRIC_REPLAYBYTES, reply->end - reply->pos);
+
+    return 0;
+#else
+    int ret;
+    int rc = -1;
+    // Persistent mode: the connection keeps its own descriptor, otherwise the shared one is opened for each access
+    int * ptmpfd = config.persistent ? &hdl->devfd : &hdl->storage->fd;
+    uint64_t waitstart = metrics_clock ();
+
+    ret = pthread_mutex_lock(&hdl->storage->mutex);
+    if ( ret != 0 ) {
+        ERROR_LOG("pthread_mutex_lock failed with %d {%s}", ret, __func__);
+        return -1;
+    }
+    METRIC_ADD(METRIC_MUTEXWAIT, metrics_clock () - waitstart);
+
+    if (config.persistent && (-1 == *ptmpfd)) {
+        DEBUG_LOG("persistent open %s", hdl->storage->path);
+        *ptmpfd = open (hdl->storage->path, O_RDWR);
+        if (-1 == *ptmpfd) {
+            ERROR_LOG("errno %d (%s) opening the tmp file {%s}", errno, strerror(errno), __func__);
+            goto unlock;
+        }
+    }
+
+    // The packets are processed in order: the data packets before a seek command are written, then the content from
+    // the seek position is read back into the reply. After the last seek command (if any), the data packets left
+    // are written and the whole content is read back
+    const char * segment = batch;
+    while (segment < batch + len) {
+        const char * seek = NULL;
+        const char * packet = segment;
+        const char * charpt;
+
+        while (packet < batch + len) {
+            charpt = memchr(packet, '\n', batch + len - packet);
+            if (is_seek_command (packet, charpt - packet + 1)) {
+                seek = packet;
+                break;
+            }
+            packet = charpt + 1;
+        }
+
+        if ((packet != segment) && (0 != device_write (hdl, ptmpfd, segment, packet - segment))) {
+            goto unlock;
+        }
+
+        if (NULL != seek) {
+            segment = charpt + 1;
+            ret = device_read_back (hdl, ptmpfd, seek, segment - seek, reply);
+        }
+        else {
+            segment = batch + len;
+            ret = device_read_back (hdl, ptmpfd, NULL, 0, reply);
+        }
+        if (0 != ret) {
+            goto unlock;
+        }
+    }
+
+    METRIC_ADD(METRIC_BATCHES, 1);
+    METRIC_ADD(METRIC_REPLAYBYTES, reply->piped + reply->end);
+    rc = 0;
+
+    unlock:
+    ret = pthread_mutex_unlock(&hdl->storage->mutex);
+    if ( ret != 0 ) {
+        ERROR_LOG("pthread_mutex_unlock failed with %d {%s}", ret, __func__);
+        rc = -1;
+    }
+
+    return rc;
+#endif
+}
+
+
+/**
+ * Arm the timestamp timer, polled by the first accept loop with its socket
+ * @return the timerfd, -1 on error
+ */
+int timestamp_open (void)
+{
+    struct itimerspec itimerspec;
+    int timerfd;
+
+    timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == timerfd) {
+        ERROR_LOG("errno %d (%s) timerfd_create() {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    memset(&itimerspec, 0, sizeof(struct itimerspec));
+    itimerspec.it_value.tv_sec = config.timestamp;
+    itimerspec.it_interval.tv_sec = config.timestamp;
+
+    if (-1 == timerfd_settime(timerfd, 0, &itimerspec, NULL)) {
+        ERROR_LOG("errno %d (%s) timerfd_settime() {%s}", errno, strerror(errno), __func__);
+        close(timerfd);
+        return -1;
+    }
+
+    return timerfd;
+}
+
+
+/**
+ * Append a timestamp line once the timer expired, through the same path as a batch of client packets.
+ * Expirations missed while the accept loop was busy give a single timestamp
+ * @return 0 on success (or if the timer didn't expire), -1 on error
+ */
+int timestamp_append (storage_t * storage, int timerfd)
+{
+    char timebuff[TIMEBUFFLEN];
+    uint64_t expirations;
+    time_t timenow;
+    size_t len;
+
+    if (sizeof(uint64_t) != read(timerfd, &expirations, sizeof(uint64_t))) {
+        return (EAGAIN == errno) ? 0 : -1;
+    }
+
+    timenow = time(NULL);
+    len = strftime(timebuff, sizeof(timebuff) - 1, config.timeformat, localtime(&timenow));
+    if (0 == len) {
+        ERROR_LOG("timestamp format too long or empty: %s {%s}", config.timeformat, __func__);
+        return -1;
+    }
+    // a timestamp is a packet: it ends with a '\n'
+    if ('\n' != timebuff[len - 1]) {
+        timebuff[len++] = '\n';
+    }
+
+    DEBUG_LOG("%.*s", (int) (len - 1), timebuff);
+#if !USE_AESD_CHAR_DEVICE
+    off_t end;
+
+    // Same lock free append as the clients batches, made durable by the same policy
+    if (0 != storage_append (storage, timebuff, len, &end)) {
+        return -1;
+    }
+    if (SYNC_ALWAYS == config.syncpolicy) {
+        metrics_fdatasync (storage->fd);
+    }
+
+    return 0;
+#else
+    int ret;
+    int rc = -1;
+    int tmpfd;
+
+    ret = pthread_mutex_lock(&storage->mutex);
+    if ( ret != 0 ) {
+        ERROR_LOG("pthread_mutex_lock failed with %d {%s}", ret, __func__);
+        return -1;
+    }
+
+    tmpfd = open (storage->path, O_RDWR | O_CREAT | O_TRUNC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
+    if (-1 == tmpfd) {
+        ERROR_LOG("errno %d (%s) opening the tmp file {%s}", errno, strerror(errno), __func__);
+    }
+    else {
+        rc = write_packets (tmpfd, timebuff, len);
+        close (tmpfd);
+    }
+
+    ret = pthread_mutex_unlock(&storage->mutex);
+    if ( ret != 0 ) {
+        ERROR_LOG("pthread_mutex_unlock failed with %d {%s}", ret, __func__);
+        rc = -1;
+    }
+
+    return rc;
+#endif
+}
+
+
+/**
+ * Send (the rest of) a reply to the client: the piped content is spliced, the tmp file content goes through
+ * sendfile(), and only the buffered snapshots are copied from user space
+ * Blocking sockets always send the whole reply, non blocking ones stop as soon as the socket is full
+ * @return 0 once the reply is completely sent, 1 if the socket would block, -1 on error
+ */
+int send_reply (handlers_t * hdl, reply_t * reply)
+{
+    ssize_t written;
+
+    while (0 < reply->piped) {
+        written = splice(hdl->pipefd[0], NULL, hdl->clientfd, NULL, reply->piped, SPLICE_F_MOVE);
+        if (-1 == written) {
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+                return 1;
+            }
+            ERROR_LOG("errno %d (%s) splice() {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+
+        reply->piped -= written;
+        METRIC_ADD(METRIC_BYTESOUT, written);
+    }
+
+    while (reply->pos < reply->end) {
+        if (NULL != reply->buffpt) {
+            written = send(hdl->clientfd, reply->buffpt + reply->pos, reply->end - reply->pos, MSG_NOSIGNAL);
+            if (-1 != written) {
+                reply->pos += written;
+            }
+        }
+        else {
+            // sendfile() moves reply->pos forward
+            written = sendfile(hdl->clientfd, hdl->storage->fd, &reply->pos, reply->end - reply->pos);
+            if (0 == written) {
                 // nothing left to read
-                count = 0;
+                reply->end = reply->pos;
+                break;
+            }
+        }
+
+        if (-1 == written) {
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+                return 1;
+            }
+            ERROR_LOG("errno %d (%s) sending the reply {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+        METRIC_ADD(METRIC_BYTESOUT, written);
+    }
+
+    return 0;
+}
+
+
+
+#ifdef USE_IO_URING
+/**
+ * Unmap the rings and close the io_uring instance (the pending requests are cancelled)
+ */
+static void uring_close (void * uring)
+{
+    uring_t * ring = (uring_t *) uring;
+
+    if (MAP_FAILED != (void *) ring->sqes) {
+        munmap(ring->sqes, ring->sqessize);
+    }
+    if ((MAP_FAILED != ring->cqring) && (ring->cqring != ring->sqring)) {
+        munmap(ring->cqring, ring->cqringsize);
+    }
+    if (MAP_FAILED != ring->sqring) {
+        munmap(ring->sqring, ring->sqringsize);
+    }
+    if (-1 != ring->fd) {
+        close(ring->fd);
+    }
+
+    ring->sqes = MAP_FAILED;
+    ring->cqring = MAP_FAILED;
+    ring->sqring = MAP_FAILED;
+    ring->fd = -1;
+}
+
+
+/**
+ * Create the ring of a connection: the client socket, the tmp file and the reply pipe are registered as fixed files,
+ * the pool buffer of the connection as fixed buffer 0 when the kernel accepts to pin it (only its own pages are pinned)
+ * @return 0 on success, -1 if io_uring is not usable (the caller falls back to the system calls)
+ */
+static int uring_open (uring_t * ring, handlers_t * hdl)
+{
+    struct io_uring_params params;
+    struct io_uring_probe * probe;
+    struct iovec iov;
+    int files[4];
+    int pipelen;
+    static const uint8_t opcodes[] = { IORING_OP_RECV, IORING_OP_READ_FIXED, IORING_OP_WRITE, IORING_OP_WRITE_FIXED,
+                                       IORING_OP_FSYNC, IORING_OP_SPLICE };
+
+    ring->fd = -1;
+    ring->sqring = MAP_FAILED;
+    ring->cqring = MAP_FAILED;
+    ring->sqes = MAP_FAILED;
+    ring->queued = 0;
+    ring->fixedbuffer = NULL;
+
+    memset(&params, 0, sizeof(params));
+    ring->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (-1 == ring->fd) {
+        DEBUG_LOG("errno %d (%s) io_uring_setup() {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    // every operation of the engine has to be supported
+    probe = (struct io_uring_probe *) calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (NULL == probe) {
+        ERROR_LOG("io_uring probe memory allocation {%s}", __func__);
+        goto error;
+    }
+    if (-1 == syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE, probe, 256)) {
+        DEBUG_LOG("errno %d (%s) io_uring_register() PROBE {%s}", errno, strerror(errno), __func__);
+        free(probe);
+        goto error;
+    }
+    for (unsigned int i = 0; i < sizeof(opcodes); i++) {
+        if ((opcodes[i] > probe->last_op) || !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED)) {
+            DEBUG_LOG("io_uring opcode %u not supported {%s}", opcodes[i], __func__);
+            free(probe);
+            goto error;
+        }
+    }
+    free(probe);
+
+    ring->sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqringsize = (ring->cqringsize > ring->sqringsize) ? ring->cqringsize : ring->sqringsize;
+        ring->cqringsize = ring->sqringsize;
+    }
+
+    ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->sqring) {
+        ERROR_LOG("errno %d (%s) mmap() SQ ring {%s}", errno, strerror(errno), __func__);
+        goto error;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqring = ring->sqring;
+    }
+    else {
+        ring->cqring = mmap(NULL, ring->cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == ring->cqring) {
+            ERROR_LOG("errno %d (%s) mmap() CQ ring {%s}", errno, strerror(errno), __func__);
+            goto error;
+        }
+    }
+
+    ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == (void *) ring->sqes) {
+        ERROR_LOG("errno %d (%s) mmap() SQEs {%s}", errno, strerror(errno), __func__);
+        goto error;
+    }
+
+    ring->sqhead = (unsigned int *) ((char *) ring->sqring + params.sq_off.head);
+    ring->sqtail = (unsigned int *) ((char *) ring->sqring + params.sq_off.tail);
+    ring->sqmask = *(unsigned int *) ((char *) ring->sqring + params.sq_off.ring_mask);
+    ring->sqarray = (unsigned int *) ((char *) ring->sqring + params.sq_off.array);
+    ring->cqhead = (unsigned int *) ((char *) ring->cqring + params.cq_off.head);
+    ring->cqtail = (unsigned int *) ((char *) ring->cqring + params.cq_off.tail);
+    ring->cqmask = *(unsigned int *) ((char *) ring->cqring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cqring + params.cq_off.cqes);
+
+    // the reply pipe, spliced from the tmp file and to the socket
+    if (-1 == hdl->pipefd[0]) {
+        if (-1 == pipe2(hdl->pipefd, O_CLOEXEC)) {
+            ERROR_LOG("errno %d (%s) pipe2() {%s}", errno, strerror(errno), __func__);
+            goto error;
+        }
+        fcntl(hdl->pipefd[1], F_SETPIPE_SZ, REPLY_PIPELEN);
+    }
+    pipelen = fcntl(hdl->pipefd[1], F_GETPIPE_SZ);
+    if (-1 == pipelen) {
+        ERROR_LOG("errno %d (%s) fcntl() F_GETPIPE_SZ {%s}", errno, strerror(errno), __func__);
+        goto error;
+    }
+    ring->pipelen = pipelen;
+
+    files[URING_CLIENT] = hdl->clientfd;
+    files[URING_STORAGE] = hdl->storage->fd;
+    files[URING_PIPEOUT] = hdl->pipefd[0];
+    files[URING_PIPEIN] = hdl->pipefd[1];
+    if (-1 == syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, files, 4)) {
+        ERROR_LOG("errno %d (%s) io_uring_register() FILES {%s}", errno, strerror(errno), __func__);
+        goto error;
+    }
+
+    // the reception buffer is taken now to be registered; once grown out of the pool (or without the fixed buffer,
+    // memlock limit), the plain read and write operations are used
+    if (-1 == rxbuffer_reserve (hdl)) {
+        goto error;
+    }
+    if (bufpool_owns (&bufpool, hdl->buffpt)) {
+        iov.iov_base = hdl->buffpt;
+        iov.iov_len = hdl->buffsize;
+        if (0 == syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1)) {
+            ring->fixedbuffer = hdl->buffpt;
+        }
+    }
+
+    return 0;
+
+    error:
+    uring_close (ring);
+    return -1;
+}
+
+
+/**
+ * Replace the registered tmp file by the one of the stream the connection selected
+ * @return 0 on success, -1 on error
+ */
+static int uring_update_storage (uring_t * ring, handlers_t * hdl)
+{
+    struct io_uring_files_update update;
+    int fd = hdl->storage->fd;
+
+    memset(&update, 0, sizeof(struct io_uring_files_update));
+    update.offset = URING_STORAGE;
+    update.fds = (uint64_t) (uintptr_t) &fd;
+
+    if (1 != syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1)) {
+        ERROR_LOG("errno %d (%s) io_uring_register() FILES_UPDATE {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Prepare the next submission entry, its user_data is its rank in the submission
+ * @param fixedfd registered file the operation works on
+ */
+static struct io_uring_sqe * uring_prepare (uring_t * ring, uint8_t opcode, int fixedfd)
+{
+    unsigned int index = (*ring->sqtail + ring->queued) & ring->sqmask;
+    struct io_uring_sqe * sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fixedfd;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = ring->queued;
+
+    ring->sqarray[index] = index;
+    ring->queued++;
+
+    return sqe;
+}
+
+
+/**
+ * Submit the prepared entries and wait for all of them with, most of the time, a single io_uring_enter()
+ * @param results filled with the result of each entry, by rank
+ * @return 0 on success, -1 on error
+ */
+static int uring_submit (uring_t * ring, int * results)
+{
+    unsigned int tosubmit = ring->queued;
+    unsigned int pending = ring->queued;
+    unsigned int head;
+    int ret;
+
+    __atomic_store_n(ring->sqtail, *ring->sqtail + ring->queued, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    while (0 < pending) {
+        // the wait may be long (client silent) and io_uring_enter() isn't a cancellation point: the drain and the
+        // cleanup shut the socket down, which completes the pending reception, the cancellation is then acted upon
+        // here, between two waits (the ring is torn down by the cleanup handler anyway)
+        ret = syscall(__NR_io_uring_enter, ring->fd, tosubmit, pending, IORING_ENTER_GETEVENTS, NULL, 0);
+        pthread_testcancel();
+        if (-1 == ret) {
+            if (EINTR == errno) {
+                continue;
+            }
+            ERROR_LOG("errno %d (%s) io_uring_enter() {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+        tosubmit -= ret;
+
+        head = *ring->cqhead;
+        while (head != __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE)) {
+            results[ring->cqes[head & ring->cqmask].user_data] = ring->cqes[head & ring->cqmask].res;
+            head++;
+            pending--;
+        }
+        __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    return 0;
+}
+
+
+/**
+ * Prepare the reception of the next bytes, in the fixed buffer while the reception buffer is the registered one
+ * @return 0 on success, -1 on error
+ */
+static int uring_prepare_recv (uring_t * ring, handlers_t * hdl)
+{
+    struct io_uring_sqe * sqe;
+
+    if (-1 == rxbuffer_reserve (hdl)) {
+        return -1;
+    }
+
+    if ((NULL != ring->fixedbuffer) && (ring->fixedbuffer == hdl->buffpt)) {
+        sqe = uring_prepare (ring, IORING_OP_READ_FIXED, URING_CLIENT);
+        sqe->buf_index = 0;
+    }
+    else {
+        sqe = uring_prepare (ring, IORING_OP_RECV, URING_CLIENT);
+    }
+    sqe->addr = (uintptr_t) (hdl->buffpt + hdl->bufflen);
+    sqe->len = hdl->buffsize - hdl->bufflen;
+
+    return 0;
+}
+
+
+/**
+ * Store a batch in the tmp file: the write, linked to the fdatasync() of the always policy, takes one submission
+ * @return 0 on success, -1 on error (the room is committed anyway, it's recorded as a hole)
+ */
+static int uring_append (uring_t * ring, handlers_t * hdl, size_t len, off_t * end)
+{
+    struct io_uring_sqe * sqe;
+    int results[2] = { 0, 0 };
+    int cancelstate;
+    off_t start = storage_reserve (hdl->storage, len, &cancelstate);
+    int rc = 0;
+
+    if ((NULL != ring->fixedbuffer) && (ring->fixedbuffer == hdl->buffpt)) {
+        sqe = uring_prepare (ring, IORING_OP_WRITE_FIXED, URING_STORAGE);
+        sqe->buf_index = 0;
+    }
+    else {
+        sqe = uring_prepare (ring, IORING_OP_WRITE, URING_STORAGE);
+    }
+    sqe->addr = (uintptr_t) hdl->buffpt;
+    sqe->len = len;
+    sqe->off = start;
+
+    if (SYNC_ALWAYS == config.syncpolicy) {
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = uring_prepare (ring, IORING_OP_FSYNC, URING_STORAGE);
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+
+    if (0 != uring_submit (ring, results)) {
+        rc = -1;
+    }
+    else if (results[0] != (int) len) {
+        // short write (the fdatasync() has been cancelled), the end goes through the system calls
+        if (0 > results[0]) {
+            ERROR_LOG("errno %d (%s) io_uring write {%s}", -results[0], strerror(-results[0]), __func__);
+            rc = -1;
+        }
+        else if (((ssize_t) (len - results[0]) != pwrite (hdl->storage->fd, hdl->buffpt + results[0], len - results[0], start + results[0]))
+                 || ((SYNC_ALWAYS == config.syncpolicy) && (0 != metrics_fdatasync (hdl->storage->fd)))) {
+            ERROR_LOG("errno %d (%s) completing a short write {%s}", errno, strerror(errno), __func__);
+            rc = -1;
+        }
+    }
+
+    if (0 != rc) {
+        storage_hole (hdl->storage, start, len);
+    }
+    storage_commit (hdl->storage, start, len, cancelstate);
+
+    *end = start + (off_t) len;
+    return rc;
+}
+
+
+/**
+ * Send a reply straight from the tmp file: pairs of splices (file to pipe, pipe to socket) are linked, chunk after chunk,
+ * and the reception of the next packet is linked after the last one, everything in as few submissions as possible.
+ * A short transfer breaks the link, the rest of the reply is then sent with the system calls
+ * @return 0 on success (the next reception is prepared or submitted), -1 on error
+ */
+static int uring_reply (uring_t * ring, handlers_t * hdl, reply_t * reply, int * results, unsigned int * recvrank)
+{
+    struct io_uring_sqe * sqe = NULL;
+    off_t queued;
+    size_t chunk;
+    size_t topipe;
+    size_t tosocket;
+    unsigned int pairs;
+
+    while (reply->pos < reply->end) {
+        queued = reply->pos;
+        pairs = 0;
+
+        while ((queued < reply->end) && (pairs < URING_MAXCHUNKS)) {
+            chunk = ((size_t) (reply->end - queued) < ring->pipelen) ? (size_t) (reply->end - queued) : ring->pipelen;
+
+            sqe = uring_prepare (ring, IORING_OP_SPLICE, URING_PIPEIN);
+            sqe->splice_fd_in = URING_STORAGE;
+            sqe->splice_off_in = queued;
+            sqe->off = (uint64_t) -1;
+            sqe->len = chunk;
+            sqe->splice_flags = SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE;
+            sqe->flags |= IOSQE_IO_LINK;
+
+            sqe = uring_prepare (ring, IORING_OP_SPLICE, URING_CLIENT);
+            sqe->splice_fd_in = URING_PIPEOUT;
+            sqe->splice_off_in = (uint64_t) -1;
+            sqe->off = (uint64_t) -1;
+            sqe->len = chunk;
+            sqe->splice_flags = SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE;
+            sqe->flags |= IOSQE_IO_LINK;
+
+            queued += chunk;
+            pairs++;
+        }
+
+        if (queued == reply->end) {
+            // the whole reply is queued, the next reception follows it
+            *recvrank = ring->queued;
+            if (0 != uring_prepare_recv (ring, hdl)) {
+                return -1;
+            }
+        }
+        else if (NULL != sqe) {
+            sqe->flags &= ~IOSQE_IO_LINK;
+        }
+
+        if (0 != uring_submit (ring, results)) {
+            return -1;
+        }
+
+        topipe = 0;
+        tosocket = 0;
+        for (unsigned int i = 0; i < pairs; i++) {
+            if ((0 > results[2 * i + 1]) && (-ECANCELED != results[2 * i + 1])) {
+                ERROR_LOG("errno %d (%s) io_uring splice to the socket {%s}", -results[2 * i + 1], strerror(-results[2 * i + 1]), __func__);
+                return -1;
+            }
+            topipe += (0 < results[2 * i]) ? results[2 * i] : 0;
+            tosocket += (0 < results[2 * i + 1]) ? results[2 * i + 1] : 0;
+        }
+        METRIC_ADD(METRIC_BYTESOUT, tosocket);
+
+        if (topipe != (size_t) (queued - reply->pos) || (tosocket != topipe)) {
+            // broken link: what is left in the pipe and after it is sent synchronously, the reception is prepared again
+            reply->piped = topipe - tosocket;
+            reply->pos += topipe;
+            *recvrank = URING_DEPTH;
+            return send_reply (hdl, reply);
+        }
+
+        reply->pos = queued;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Serve a connection through io_uring: per packet, one submission stores the batch (and makes it durable),
+ * a second one sends the reply and starts the reception of the next packet.
+ * The connection is served the same way as serve_connection() (file storage and blocking socket only)
+ * @return 0 once the connection is over, -1 if io_uring is not usable before anything has been received
+ */
+int uring_serve_connection (handlers_t * hdl)
+{
+    uring_t ring;
+    int results[URING_DEPTH];
+    unsigned int recvrank;
+    size_t towrite;
+    reply_t reply;
+    off_t end;
+    uint64_t throttle;
+    struct timespec delay;
+    int selected;
+
+    if (0 != uring_open (&ring, hdl)) {
+        return -1;
+    }
+
+    syslog (LOG_DEBUG, "Accepted connection from %s", hdl->clentaddr);
+
+    // a cancelled thread gives its ring back
+    pthread_cleanup_push(uring_close, &ring);
+
+    recvrank = URING_DEPTH;
+    memset(&reply, 0, sizeof(reply_t));
+
+    while ( !signal_to_get_out ) {
+        // the reception is submitted alone when it couldn't follow a reply
+        if (URING_DEPTH == recvrank) {
+            recvrank = ring.queued;
+            if ((0 != uring_prepare_recv (&ring, hdl)) || (0 != uring_submit (&ring, results))) {
+                break;
+            }
+        }
+
+        if (0 > results[recvrank]) {
+            if (-ECANCELED == results[recvrank]) {
+                recvrank = URING_DEPTH;
+                continue;
+            }
+            ERROR_LOG("errno %d (%s) io_uring recv {%s}", -results[recvrank], strerror(-results[recvrank]), __func__);
+            break;
+        }
+        else if (0 == results[recvrank]) {
+            // client disconnected, let's terminate
+            DEBUG_LOG("client disconnected (descriptor %d) {%s}", hdl->clientfd, __func__);
+            break;
+        }
+
+        hdl->bufflen += results[recvrank];
+        METRIC_ADD(METRIC_BYTESIN, results[recvrank]);
+        recvrank = URING_DEPTH;
+
+        // Store the batch and send back the resulting content
+        if (-1 == rxbuffer_batch (hdl, &towrite)) {
+            break;
+        }
+        selected = stream_select (hdl, &towrite);
+        if ((-1 == selected) || ((1 == selected) && (0 != uring_update_storage (&ring, hdl)))) {
+            break;
+        }
+        if (0 != towrite) {
+            if (0 != uring_append (&ring, hdl, towrite, &end)) {
+                break;
+            }
+            if (SYNC_BATCH == config.syncpolicy) {
+                storage_wait_durable (hdl->storage, end);
+            }
+            throttle = ratelimit_charge (hdl, hdl->buffpt, towrite);
+            rxbuffer_consume (hdl, towrite);
+
+            reply.pos = config.cursor ? hdl->cursor : 0;
+            reply.end = end;
+            hdl->cursor = end;
+            if (storage_covers_hole (hdl->storage, reply.pos, reply.end)) {
+                ERROR_LOG("reply to %s would replay a hole of %s, closing {%s}", hdl->clentaddr, hdl->storage->path, __func__);
+                break;
+            }
+            METRIC_ADD(METRIC_BATCHES, 1);
+            METRIC_ADD(METRIC_REPLAYBYTES, reply.end - reply.pos);
+
+            if (0 != uring_reply (&ring, hdl, &reply, results, &recvrank)) {
+                break;
+            }
+
+            // over its rate, the reception already submitted isn't processed for a while
+            if (0 != throttle) {
+                delay.tv_sec = throttle / 1000000000ULL;
+                delay.tv_nsec = throttle % 1000000000ULL;
+                nanosleep(&delay, NULL);
+            }
+        }
+        else {
+            rxbuffer_consume (hdl, 0);
+        }
+    }
+
+    pthread_cleanup_pop(1);
+    return 0;
+}
+#endif
+
+
+/**
+ * Update the epoll events watched for a connection already in the loop epoll set
+ * @return 0 on success, -1 on error
+ */
+static int eventloop_watch (handlers_t * hdl, uint32_t events)
+{
+    struct epoll_event event;
+
+    if (events == hdl->events) {
+        return 0;
+    }
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = events;
+    event.data.ptr = hdl;
+
+    if (-1 == epoll_ctl(hdl->loop->epfd, EPOLL_CTL_MOD, hdl->clientfd, &event)) {
+        ERROR_LOG("errno %d (%s) epoll_ctl() {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    hdl->events = events;
+    return 0;
+}
+
+
+/**
+ * Watch a connection for reception again unless it's finished, paused by its queued replies or throttled
+ * @return 0 on success, -1 on error
+ */
+static int eventloop_resume (handlers_t * hdl)
+{
+    if (hdl->eof || hdl->paused || hdl->throttled) {
+        return 0;
+    }
+    return eventloop_watch (hdl, hdl->events | EPOLLIN);
+}
+
+
+/**
+ * Release everything owned by an event loop connection and recycle its handler
+ */
+static void eventloop_close (handlers_t * hdl)
+{
+    handlers_t ** link;
+
+    if (hdl->held) {
+        for (link = &hdl->loop->held; *link != hdl; link = &(*link)->heldnext);
+        *link = hdl->heldnext;
+        hdl->held = false;
+    }
+
+    if (hdl->throttled) {
+        for (link = &hdl->loop->throttled; *link != hdl; link = &(*link)->throttlednext);
+        *link = hdl->throttlednext;
+        hdl->throttled = false;
+    }
+
+    // closing the descriptor removes it from the epoll set as well
+    release_handler (hdl);
+
+    syslog (LOG_DEBUG, "Closed connection from %s", hdl->clentaddr);
+    registry_release (hdl->registry, hdl);
+}
+
+
+/**
+ * Send as many queued replies as the socket accepts, watching for EPOLLOUT if some are left
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int eventloop_flush (handlers_t * hdl)
+{
+    reply_t * reply;
+    size_t left;
+    int ret;
+
+    while (NULL != hdl->replyhead) {
+        if (hdl->replyhead->syncend > atomic_load(&hdl->storage->durable)) {
+            // not acknowledged before the group commit covers it, the flusher will wake the loop up
+            if (!hdl->held) {
+                hdl->held = true;
+                hdl->heldnext = hdl->loop->held;
+                hdl->loop->held = hdl;
+            }
+            return eventloop_watch (hdl, hdl->events & ~EPOLLOUT);
+        }
+
+        left = hdl->replyhead->piped + (hdl->replyhead->end - hdl->replyhead->pos);
+        ret = send_reply (hdl, hdl->replyhead);
+        hdl->queued -= left - (hdl->replyhead->piped + (hdl->replyhead->end - hdl->replyhead->pos));
+
+        // read again once the client caught up with its replies
+        if (hdl->paused && (hdl->queued <= config.lowwater)) {
+            hdl->paused = false;
+            if (-1 == eventloop_resume (hdl)) {
+                return -1;
+            }
+        }
+
+        if (1 == ret) {
+            return eventloop_watch (hdl, hdl->events | EPOLLOUT);
+        }
+        else if (0 != ret) {
+            return -1;
+        }
+
+        reply = hdl->replyhead;
+        hdl->replyhead = reply->next;
+        if (NULL == hdl->replyhead) {
+            hdl->replytail = NULL;
+        }
+        reply->next = hdl->replyfree;
+        hdl->replyfree = reply;
+    }
+
+    if (hdl->eof) {
+        // everything has been answered to a client which has nothing more to say
+        return -1;
+    }
+
+    return eventloop_watch (hdl, hdl->events & ~EPOLLOUT);
+}
+
+
+/**
+ * Receive everything available on a connection, storing and queuing a reply for each complete packet
+ * @return 0 to keep the connection, -1 to close it
+ */
+static int eventloop_receive (handlers_t * hdl)
+{
+    ssize_t count;
+    size_t towrite;
+    reply_t * reply;
+    uint64_t throttle;
+
+    while (!hdl->eof && !hdl->paused && !hdl->throttled) {
+        if (-1 == rxbuffer_reserve (hdl)) {
+            return -1;
+        }
+
+        count = recv(hdl->clientfd, hdl->buffpt + hdl->bufflen, hdl->buffsize - hdl->bufflen, 0);
+        if (-1 == count) {
+            if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
                 break;
             }
-            
-            count -= filepos;
+            if (EINTR == errno) {
+                continue;
+            }
+            ERROR_LOG("errno %d (%s) recv() {%s}", errno, strerror(errno), __func__);
+            return -1;
+        }
+        else if (0 == count) {
+            // client disconnected, an incomplete packet is dropped
+            DEBUG_LOG("client disconnected (descriptor %d) {%s}", hdl->clientfd, __func__);
+            hdl->eof = true;
+            if (-1 == eventloop_watch (hdl, hdl->events & ~EPOLLIN)) {
+                return -1;
+            }
+            break;
+        }
+
+        hdl->bufflen += count;
+        METRIC_ADD(METRIC_BYTESIN, count);
+
+        // The complete packets received are processed as one batch, answered by a single reply
+        if ((-1 == rxbuffer_batch (hdl, &towrite)) || (-1 == stream_select (hdl, &towrite))) {
+            return -1;
+        }
+        if (0 != towrite) {
+            // the replies already sent are recycled
+            reply = hdl->replyfree;
+            if (NULL != reply) {
+                hdl->replyfree = reply->next;
+            }
+            else {
+                reply = (reply_t *) malloc(sizeof(reply_t));
+                if (NULL == reply) {
+                    ERROR_LOG("reply memory allocation {%s}", __func__);
+                    return -1;
+                }
+                reply->buffpt = NULL;
+                reply->buffsize = 0;
+            }
+
+            if (0 != process_batch (hdl, hdl->buffpt, towrite, reply)) {
+                reply->next = hdl->replyfree;
+                hdl->replyfree = reply;
+                return -1;
+            }
+
+            if (NULL == hdl->replytail) {
+                hdl->replyhead = reply;
+            }
+            else {
+                hdl->replytail->next = reply;
+            }
+            hdl->replytail = reply;
+            hdl->queued += reply->piped + (reply->end - reply->pos);
+
+            // a client not reading its replies isn't read anymore either, until they fall under the low watermark
+            if ((0 < config.highwater) && (hdl->queued >= config.highwater)) {
+                DEBUG_LOG("%zu reply bytes queued for %s, pausing {%s}", hdl->queued, hdl->clentaddr, __func__);
+                METRIC_ADD(METRIC_PAUSES, 1);
+                hdl->paused = true;
+            }
+
+            // over its rate, the connection isn't read until it paid its debt back
+            throttle = ratelimit_charge (hdl, hdl->buffpt, towrite);
+            if (0 != throttle) {
+                hdl->throttled = true;
+                hdl->resume = metrics_clock () + throttle;
+                hdl->throttlednext = hdl->loop->throttled;
+                hdl->loop->throttled = hdl;
+            }
+
+            if (hdl->paused || hdl->throttled) {
+                if (-1 == eventloop_watch (hdl, hdl->events & ~EPOLLIN)) {
+                    return -1;
+                }
+            }
+        }
+        rxbuffer_consume (hdl, towrite);
+    }
+
+    return eventloop_flush (hdl);
+}
+
+
+/**
+ * Event loop thread: multiplexes the client sockets handed over by the acceptor
+ */
+void * eventloop_thread (void * eventloop)
+{
+    eventloop_t * loop = (eventloop_t *) eventloop;
+    struct epoll_event events[EVENTLOOP_MAXEVENTS];
+    struct epoll_event event;
+    handlers_t * hdl;
+    handlers_t * held;
+    handlers_t ** link;
+    uint64_t wakeups;
+    uint64_t now;
+    sigset_t sigset;
+    ssize_t count;
+    int timeout;
+    int n;
+
+    // Termination signals are left to the acceptor thread
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    // Served until the acceptor asks to quit, the connections drained on exit still need the loop
+    while (true) {
+        // woken up in time for the first throttled connection to be read again
+        timeout = -1;
+        if (NULL != loop->throttled) {
+            now = metrics_clock ();
+            for (hdl = loop->throttled; NULL != hdl; hdl = hdl->throttlednext) {
+                if (hdl->resume <= now) {
+                    timeout = 0;
+                    break;
+                }
+                if ((-1 == timeout) || ((hdl->resume - now + 999999) / 1000000 < (uint64_t) timeout)) {
+                    timeout = (hdl->resume - now + 999999) / 1000000;
+                }
+            }
+        }
+
+        n = epoll_wait(loop->epfd, events, EVENTLOOP_MAXEVENTS, timeout);
+        if (-1 == n) {
+            if (EINTR == errno) {
+                continue;
+            }
+            ERROR_LOG("errno %d (%s) epoll_wait() {%s}", errno, strerror(errno), __func__);
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (loop == events[i].data.ptr) {
+                // The group commit moved forward: the held connections try again
+                if (sizeof(uint64_t) != read(loop->syncfd, &wakeups, sizeof(uint64_t))) {
+                    continue;
+                }
+
+                held = loop->held;
+                loop->held = NULL;
+                while (NULL != held) {
+                    hdl = held;
+                    held = hdl->heldnext;
+                    hdl->held = false;
+
+                    if (-1 == eventloop_flush (hdl)) {
+                        eventloop_close (hdl);
+                    }
+                }
+                continue;
+            }
+
+            if (NULL == events[i].data.ptr) {
+                // New connections from the acceptor (or NULL to quit)
+                count = read(loop->notifyfd[0], &hdl, sizeof(handlers_t *));
+                if (sizeof(handlers_t *) != count) {
+                    continue;
+                }
+                if (NULL == hdl) {
+                    goto end;
+                }
+
+                hdl->loop = loop;
+
+                syslog (LOG_DEBUG, "Accepted connection from %s", hdl->clentaddr);
+
+                memset(&event, 0, sizeof(struct epoll_event));
+                event.events = EPOLLIN;
+                event.data.ptr = hdl;
+                if (-1 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, hdl->clientfd, &event)) {
+                    ERROR_LOG("errno %d (%s) epoll_ctl() {%s}", errno, strerror(errno), __func__);
+                    eventloop_close (hdl);
+                    continue;
+                }
+                hdl->events = EPOLLIN;
+                continue;
+            }
+
+            hdl = (handlers_t *) events[i].data.ptr;
+
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                if (-1 == eventloop_receive (hdl)) {
+                    eventloop_close (hdl);
+                    continue;
+                }
+            }
+
+            if (events[i].events & EPOLLOUT) {
+                if (-1 == eventloop_flush (hdl)) {
+                    eventloop_close (hdl);
+                    continue;
+                }
+            }
+        }
+
+        // The throttled connections which paid their debt back are read again, level triggered epoll
+        // reports what arrived meanwhile on the next wait (after the batch, no event left refers to them)
+        if (NULL != loop->throttled) {
+            now = metrics_clock ();
+            link = &loop->throttled;
+            while (NULL != *link) {
+                hdl = *link;
+                if (hdl->resume > now) {
+                    link = &hdl->throttlednext;
+                    continue;
+                }
+                *link = hdl->throttlednext;
+                hdl->throttled = false;
+
+                if (-1 == eventloop_resume (hdl)) {
+                    eventloop_close (hdl);
+                }
+            }
+        }
+    }
+
+    // the connections left are released with the registry ones
+    end:
+    return NULL;
+}
+
+
+/**
+ * Create the epoll set and notification pipe of an event loop and start its thread
+ * @return 0 on success, -1 on error
+ */
+int start_eventloop (eventloop_t * loop)
+{
+    struct epoll_event event;
+    int status;
+
+    loop->pthread = 0;
+    loop->notifyfd[0] = -1;
+    loop->notifyfd[1] = -1;
+    loop->syncfd = -1;
+    loop->held = NULL;
+    loop->throttled = NULL;
+
+    loop->epfd = epoll_create1(0);
+    if (-1 == loop->epfd) {
+        ERROR_LOG("errno %d (%s) epoll_create1() {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    if (-1 == pipe(loop->notifyfd)) {
+        ERROR_LOG("errno %d (%s) pipe() {%s}", errno, strerror(errno), __func__);
+        loop->notifyfd[0] = -1;
+        goto error;
+    }
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (-1 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->notifyfd[0], &event)) {
+        ERROR_LOG("errno %d (%s) epoll_ctl() {%s}", errno, strerror(errno), __func__);
+        goto error;
+    }
+
+    loop->syncfd = eventfd(0, EFD_NONBLOCK);
+    if (-1 == loop->syncfd) {
+        ERROR_LOG("errno %d (%s) eventfd() {%s}", errno, strerror(errno), __func__);
+        goto error;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = loop;
+    if (-1 == epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->syncfd, &event)) {
+        ERROR_LOG("errno %d (%s) epoll_ctl() {%s}", errno, strerror(errno), __func__);
+        goto error;
+    }
+
+    status = pthread_create (&loop->pthread, NULL, eventloop_thread, (void *) loop);
+    if (0 != status) {
+        ERROR_LOG("creation of event loop thread code %d {%s}", status, __func__);
+        loop->pthread = 0;
+        goto error;
+    }
+
+    return 0;
+
+    error:
+    if (-1 != loop->syncfd) {
+        close(loop->syncfd);
+        loop->syncfd = -1;
+    }
+    if (-1 != loop->notifyfd[0]) {
+        close(loop->notifyfd[0]);
+        close(loop->notifyfd[1]);
+        loop->notifyfd[0] = -1;
+        loop->notifyfd[1] = -1;
+    }
+    close(loop->epfd);
+    loop->epfd = -1;
+    return -1;
+}
+
+
+/**
+ * Hand an accepted connection over to an event loop, the loop owns the handler from now on
+ * @return 0 on success, -1 on error (the handler and its socket are released)
+ */
+int handover_connection (eventloop_t * loop, handlers_t * hdl)
+{
+    int flags;
+
+    flags = fcntl(hdl->clientfd, F_GETFL, 0);
+    if ((-1 == flags) || (-1 == fcntl(hdl->clientfd, F_SETFL, flags | O_NONBLOCK))) {
+        ERROR_LOG("errno %d (%s) fcntl() O_NONBLOCK {%s}", errno, strerror(errno), __func__);
+        release_handler (hdl);
+        registry_release (hdl->registry, hdl);
+        return -1;
+    }
+
+    // a pointer is far below PIPE_BUF, the write is atomic
+    if (sizeof(handlers_t *) != write(loop->notifyfd[1], &hdl, sizeof(handlers_t *))) {
+        ERROR_LOG("errno %d (%s) write() to the event loop {%s}", errno, strerror(errno), __func__);
+        release_handler (hdl);
+        registry_release (hdl->registry, hdl);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Ask the event loops to quit, wait for them, and release their resources (the connections stay in the registry)
+ */
+void stop_eventloops (eventloop_t * loops, unsigned int loopcount)
+{
+    handlers_t * hdl = NULL;
+
+    for (int i = 0; i < loopcount; i++) {
+        if (0 != loops[i].pthread) {
+            DEBUG_LOG("STOP event loop #%d {%s}", i, __func__);
+            if (sizeof(handlers_t *) != write(loops[i].notifyfd[1], &hdl, sizeof(handlers_t *))) {
+                pthread_cancel(loops[i].pthread);
+            }
+        }
+    }
 
-            tmppt = hdl->buffpt;
-            while(filepos > 0) {
-                written = send(hdl->clientfd, tmppt, filepos, 0);
-                if (-1 == written) {
-                    perror("Error server client app: Send");
-                    goto end;
-                }
+    for (int i = 0; i < loopcount; i++) {
+        if (0 != loops[i].pthread) {
+            DEBUG_LOG("JOINING event loop #%d {%s}", i, __func__);
+            pthread_join(loops[i].pthread, NULL);
+            loops[i].pthread = 0;
+        }
+
+        if (-1 != loops[i].notifyfd[0]) {
+            close(loops[i].notifyfd[0]);
+            close(loops[i].notifyfd[1]);
+        }
+
+        if (-1 != loops[i].syncfd) {
+            close(loops[i].syncfd);
+        }
+
+        if (-1 != loops[i].epfd) {
+            close(loops[i].epfd);
+        }
+    }
+}
+
+
+/**
+ * Take a connection from a worker deque, from the top (oldest) for its owner or the bottom (newest) for a thief
+ * @return the handler, NULL if the deque is empty
+ */
+static handlers_t * worker_take (worker_t * worker, bool steal)
+{
+    handlers_t * hdl = NULL;
+
+    pthread_mutex_lock(&worker->mutex);
+    if (worker->top != worker->bottom) {
+        if (steal) {
+            worker->bottom--;
+            hdl = worker->deque[worker->bottom % WORKER_QUEUELEN];
+        }
+        else {
+            hdl = worker->deque[worker->top % WORKER_QUEUELEN];
+            worker->top++;
+        }
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    return hdl;
+}
+
+
+/**
+ * Find the next connection to serve: from the own deque first, then stolen from the other workers
+ * @return the handler, NULL if every deque is empty
+ */
+static handlers_t * worker_next (worker_t * worker)
+{
+    workpool_t * pool = worker->pool;
+    handlers_t * hdl;
+
+    hdl = worker_take (worker, false);
+    for (unsigned int i = 1; (NULL == hdl) && (i < pool->count); i++) {
+        hdl = worker_take (&pool->workers[(worker->id + i) % pool->count], true);
+    }
+
+    if (NULL != hdl) {
+        atomic_fetch_sub(&pool->queued, 1);
+
+        pthread_mutex_lock(&pool->mutex);
+        pthread_cond_signal(&pool->space);
+        pthread_mutex_unlock(&pool->mutex);
+    }
 
-                tmppt += written;
-                filepos -= written;
+    return hdl;
+}
+
+
+/**
+ * Worker thread: serves the connections of its deque, or stolen ones, until cancelled
+ */
+void * worker_thread (void * arg)
+{
+    worker_t * worker = (worker_t *) arg;
+    workpool_t * pool = worker->pool;
+    handlers_t * hdl;
+    sigset_t sigset;
+
+    // the signals are for the acceptor
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    while (1) {
+        hdl = worker_next (worker);
+        if (NULL == hdl) {
+            // nothing to do nor to steal, sleep until the acceptor queues a connection
+            pthread_mutex_lock(&pool->mutex);
+            pthread_cleanup_push(unlock_mutex, &pool->mutex);
+            while (0 == atomic_load(&pool->queued)) {
+                pthread_cond_wait(&pool->work, &pool->mutex);
             }
+            pthread_cleanup_pop(1);
+            continue;
         }
-#ifndef USE_AESD_CHAR_DEVICE
-        fsync(*hdl->ptmpfd);
-#else
-	close (*hdl->ptmpfd);
-        *hdl->ptmpfd = -1;
-#endif
 
-        ret = pthread_mutex_unlock(hdl->pmutex);
-        if ( ret != 0 ) {
-            printf("Error server client app: pthread_mutex_unlock failed with %d\n", ret);
-            goto end;
+        serve_connection (hdl);
+
+        release_handler (hdl);
+
+        syslog (LOG_DEBUG, "Closed connection from %s", hdl->clentaddr);
+
+        registry_release (hdl->registry, hdl);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Allocate the worker deques and spawn the worker threads
+ * @return 0 on success, -1 on error (the workers started are stopped by stop_workers())
+ */
+int start_workers (workpool_t * pool, unsigned int count)
+{
+    int status;
+
+    pool->count = 0;
+    atomic_init(&pool->next, 0);
+    atomic_init(&pool->queued, 0);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->space, NULL);
+
+    pool->workers = (worker_t *) malloc(count * sizeof(worker_t));
+    if (NULL == pool->workers) {
+        ERROR_LOG("worker_t table memory allocation {%s}", __func__);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        worker_t * worker = &pool->workers[i];
+
+        worker->pthread = 0;
+        pthread_mutex_init(&worker->mutex, NULL);
+        worker->top = 0;
+        worker->bottom = 0;
+        worker->pool = pool;
+        worker->id = i;
+        pool->count++;
+
+        status = pthread_create (&worker->pthread, NULL, worker_thread, (void *) worker);
+        if (0 != status) {
+            ERROR_LOG("creation of worker thread #%u code %d {%s}", i, status, __func__);
+            worker->pthread = 0;
+            return -1;
         }
+    }
 
-        free(hdl->buffpt);
-        hdl->buffpt = NULL;
+    return 0;
+}
+
+
+/**
+ * Queue an accepted connection on the next worker deque having room, in a round robin manner.
+ * When every deque is full the acceptor waits: the pending connections stay in the listen backlog
+ * @return 0 on success, -1 if asked to quit (the handler is released)
+ */
+int dispatch_connection (workpool_t * pool, handlers_t * hdl)
+{
+    struct timespec deadline;
+    worker_t * worker;
+
+    while (!signal_to_get_out) {
+        for (unsigned int i = 0; i < pool->count; i++) {
+            worker = &pool->workers[atomic_fetch_add(&pool->next, 1) % pool->count];
+
+            pthread_mutex_lock(&worker->mutex);
+            if (WORKER_QUEUELEN > (worker->bottom - worker->top)) {
+                worker->deque[worker->bottom % WORKER_QUEUELEN] = hdl;
+                worker->bottom++;
+                pthread_mutex_unlock(&worker->mutex);
+
+                atomic_fetch_add(&pool->queued, 1);
+
+                pthread_mutex_lock(&pool->mutex);
+                pthread_cond_signal(&pool->work);
+                pthread_mutex_unlock(&pool->mutex);
+                return 0;
+            }
+            pthread_mutex_unlock(&worker->mutex);
+        }
+
+        // every worker is busy with a full deque, check now and then for a signal
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 100 * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&pool->mutex);
+        if (atomic_load(&pool->queued) >= pool->count * WORKER_QUEUELEN) {
+            pthread_cond_timedwait(&pool->space, &pool->mutex, &deadline);
+        }
+        pthread_mutex_unlock(&pool->mutex);
     }
 
-    end:
-    if (NULL != hdl->buffpt) {
-        DEBUG_LOG("FREE buffpt {%s}", __func__);
-        free(hdl->buffpt);
-        hdl->buffpt = NULL;
+    release_handler (hdl);
+    registry_release (hdl->registry, hdl);
+    return -1;
+}
+
+
+/**
+ * Cancel and join the workers, and free the deques (the connections served or queued stay in the registry)
+ */
+void stop_workers (workpool_t * pool)
+{
+    for (unsigned int i = 0; i < pool->count; i++) {
+        if (0 != pool->workers[i].pthread) {
+            DEBUG_LOG("CANCEL worker #%u {%s}", i, __func__);
+            pthread_cancel(pool->workers[i].pthread);
+        }
     }
 
-    if (-1 != hdl->clientfd) {
-        DEBUG_LOG("CLOSE clientfd {%s}", __func__);
-        close(hdl->clientfd);
-        hdl->clientfd = -1;
+    for (unsigned int i = 0; i < pool->count; i++) {
+        if (0 != pool->workers[i].pthread) {
+            DEBUG_LOG("JOINING worker #%u {%s}", i, __func__);
+            pthread_join(pool->workers[i].pthread, NULL);
+        }
+        pthread_mutex_destroy(&pool->workers[i].mutex);
+    }
+
+    free(pool->workers);
+    pool->workers = NULL;
+    pool->count = 0;
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->space);
+}
+
+
+/**
+ * Create a listening socket bound to the service, sharing the port through SO_REUSEPORT when several listeners are requested.
+ * SO_REUSEADDR lets a restart bind while the connections closed by the drain are still in TIME_WAIT
+ * @return the socket descriptor, -1 on error
+ */
+int open_listener (struct addrinfo * servinfo)
+{
+    int sockfd;
+    int optval = 1;
+
+    sockfd = socket (servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (-1 == sockfd) {
+        ERROR_LOG("errno %d (%s) getting a socket {%s}",errno,strerror(errno), __func__);
+        return -1;
+    }
+
+    if (-1 == setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval))) {
+        ERROR_LOG("errno %d (%s) setting SO_REUSEADDR {%s}",errno,strerror(errno), __func__);
+        close(sockfd);
+        return -1;
+    }
+
+    if ((1 < config.listeners) && (-1 == setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)))) {
+        ERROR_LOG("errno %d (%s) setting SO_REUSEPORT {%s}",errno,strerror(errno), __func__);
+        close(sockfd);
+        return -1;
+    }
+
+    if (-1 == bind (sockfd, servinfo->ai_addr, servinfo->ai_addrlen)) {
+        ERROR_LOG("errno %d (%s) binding to the socket {%s}",errno,strerror(errno), __func__);
+        close(sockfd);
+        return -1;
+    }
+
+    if (-1 == listen (sockfd, BACKLOG)) {
+        ERROR_LOG("errno %d (%s) listening to the socket {%s}",errno,strerror(errno), __func__);
+        close(sockfd);
+        return -1;
+    }
+
+    return sockfd;
+}
+
+
+/**
+ * Wait for a connection to accept, appending the timestamps when the timer of the listener expires meanwhile.
+ * poll() is never restarted after a signal handler: it's only left for a signal asking to quit
+ * @return 0 when a connection is pending, -1 on error or exit signal (errno set by poll())
+ */
+static int listener_wait (listener_t * listener)
+{
+    struct pollfd fds[2] = { { listener->sockfd, POLLIN, 0 }, { listener->timerfd, POLLIN, 0 } };
+
+    while (true) {
+        if (-1 == poll(fds, 2, -1)) {
+            if ((EINTR == errno) && !signal_to_get_out && !atomic_load(&listener->closing)) {
+                DEBUG_LOG("errno %d (%s) catch of EINTR in poll(), waiting again {%s}", errno, strerror(errno), __func__);
+                continue;
+            }
+            return -1;
+        }
+
+        if ((0 != fds[1].revents) && (0 != timestamp_append (listener->storage, listener->timerfd))) {
+            ERROR_LOG("timestamp append problem {%s}", __func__);
+        }
+
+        if (0 != fds[0].revents) {
+            return 0;
+        }
+    }
+}
+
+
+/**
+ * Accept continuously new connections on a listener and hand each one over to an event loop,
+ * to the worker pool, or to a new server-client applicative thread.
+ * When sharded, the accept loop runs on its own core and feeds its own share of the event loops
+ * @return EXIT_SUCCESS when asked to quit, EXIT_FAILURE on error
+ */
+int accept_connections (listener_t * listener)
+{
+    int status;
+    handlers_t * hdl = NULL;
+    unsigned int nextloop = 0;
+    unsigned int loopstep = 1;
+    cpu_set_t cpuset;
+    long cores;
+
+    struct sockaddr their_addr;
+    socklen_t addr_size = sizeof (their_addr);
+
+    if (1 < config.listeners) {
+        // started after every other thread: only this accept loop and the connection threads it creates are pinned
+        cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (0 < cores) {
+            CPU_ZERO(&cpuset);
+            CPU_SET(listener->id % cores, &cpuset);
+            status = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset);
+            if (0 != status) {
+                ERROR_LOG("pinning listener #%u code %d {%s}", listener->id, status, __func__);
+            }
+        }
+
+        // the event loops are shared out between the listeners when there are enough of them
+        if (listener->loopcount >= config.listeners) {
+            nextloop = listener->id;
+            loopstep = config.listeners;
+        }
+    }
+
+    while ( !signal_to_get_out && !atomic_load(&listener->closing) ) {
+
+        // the threads over since the last connection are joined and their handler recycled
+        registry_reap (&listener->registry);
+
+        // handler prepared for a new applicative thread (or event loop connection) launched by accepting a connection
+        hdl = registry_acquire (&listener->registry, listener->storage);
+        if (NULL == hdl) {
+            return EXIT_FAILURE;
+        }
+
+
+        // a signal which doesn't ask to quit only interrupts the wait, the same handler waits again
+        do {
+            memset(&their_addr, 0, addr_size);
+            status = (-1 == listener->timerfd) ? 0 : listener_wait (listener);
+            if (0 == status) {
+                status = accept(listener->sockfd, &their_addr, &addr_size);
+            }
+        }
+        while ((-1 == status) && (EINTR == errno) && !signal_to_get_out && !atomic_load(&listener->closing));
+        if (-1 == status) {
+            if(EINTR == errno){
+                DEBUG_LOG("errno %d (%s) catch of EINTR in accept() {%s}", errno, strerror(errno), __func__);
+                return EXIT_SUCCESS;
+            }
+            if(signal_to_get_out || atomic_load(&listener->closing)){
+                DEBUG_LOG("errno %d (%s) catch of EINTR in accept() [I had treated it] {%s}", errno, strerror(errno), __func__);
+                return EXIT_SUCCESS;
+            }
+            ERROR_LOG("errno %d (%s) accepting socket {%s}", errno, strerror(errno), __func__);
+            return EXIT_FAILURE;
+        }
+
+        hdl->clientfd = status;
+        METRIC_ADD(METRIC_ACCEPTED, 1);
+        inet_ntop(AF_INET, &((struct sockaddr_in *)&their_addr)->sin_addr, hdl->clentaddr, INET_ADDRSTRLEN);
+
+        if (NULL != listener->loops) {
+            // event loop mode: the handler is handed over to the next loop in a round robin manner
+            status = handover_connection (&listener->loops[nextloop % listener->loopcount], hdl);
+            nextloop += loopstep;
+            hdl = NULL;
+            if (0 != status) {
+                ERROR_LOG("hand over of a connection to an event loop {%s}", __func__);
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        if (NULL != listener->pool) {
+            // worker pool mode: the handler is queued for the workers, waiting for room if they are all busy
+            status = dispatch_connection (listener->pool, hdl);
+            hdl = NULL;
+            if (0 != status) {
+                DEBUG_LOG("dispatch interrupted by a signal {%s}", __func__);
+                return EXIT_SUCCESS;
+            }
+            continue;
+        }
+
+        status = pthread_create (&hdl->pthread, NULL, server_client_app, (void *) hdl);
+        hdl = NULL;
+        if (0 != status) {
+            ERROR_LOG("creation of server/client app thread code %d {%s}", status, __func__);
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+/**
+ * Accept loop thread of an extra listener, the signals are left to the main thread
+ */
+void * acceptor_thread (void * listener)
+{
+    sigset_t sigset;
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    if (EXIT_SUCCESS != accept_connections ((listener_t *) listener)) {
+        ERROR_LOG("listener #%u stopped accepting {%s}", ((listener_t *) listener)->id, __func__);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Stop the accept loop threads, shutting their socket down to make accept() return, and close the extra sockets
+ */
+void stop_listeners (listener_t * listeners, unsigned int listenercount)
+{
+    for (unsigned int i = 1; i < listenercount; i++) {
+        atomic_store(&listeners[i].closing, true);
+        if (-1 != listeners[i].sockfd) {
+            shutdown(listeners[i].sockfd, SHUT_RDWR);
+        }
+    }
+
+    for (unsigned int i = 1; i < listenercount; i++) {
+        if (0 != listeners[i].pthread) {
+            DEBUG_LOG("JOINING listener #%u {%s}", i, __func__);
+            pthread_join(listeners[i].pthread, NULL);
+            listeners[i].pthread = 0;
+        }
+
+        if (-1 != listeners[i].sockfd) {
+            close(listeners[i].sockfd);
+            listeners[i].sockfd = -1;
+        }
+    }
+}
+
+
+/**
+ * Open the metrics endpoint and start its thread: a path gives a Unix socket, anything else a TCP port on the loopback
+ * @return 0 on success, -1 on error
+ */
+int start_metrics (metricsendpoint_t * endpoint, const char * address)
+{
+    struct sockaddr_un unaddr;
+    struct sockaddr_in inaddr;
+    struct sockaddr * addr;
+    socklen_t addrlen;
+    int optval = 1;
+    int status;
+
+    endpoint->pthread = 0;
+    endpoint->path = NULL;
+    atomic_init(&endpoint->closing, false);
+
+    if (NULL != strchr(address, '/')) {
+        if (strlen(address) >= sizeof(unaddr.sun_path)) {
+            ERROR_LOG("metrics socket path too long: %s {%s}", address, __func__);
+            return -1;
+        }
+        memset(&unaddr, 0, sizeof(unaddr));
+        unaddr.sun_family = AF_UNIX;
+        strcpy(unaddr.sun_path, address);
+        addr = (struct sockaddr *) &unaddr;
+        addrlen = sizeof(unaddr);
+
+        // left by a previous run
+        unlink(address);
+    }
+    else {
+        memset(&inaddr, 0, sizeof(inaddr));
+        inaddr.sin_family = AF_INET;
+        inaddr.sin_port = htons((uint16_t) strtoul(address, NULL, 10));
+        inaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr = (struct sockaddr *) &inaddr;
+        addrlen = sizeof(inaddr);
+    }
+
+    endpoint->sockfd = socket (addr->sa_family, SOCK_STREAM, 0);
+    if (-1 == endpoint->sockfd) {
+        ERROR_LOG("errno %d (%s) getting the metrics socket {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    if ((AF_INET == addr->sa_family) && (-1 == setsockopt(endpoint->sockfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)))) {
+        ERROR_LOG("errno %d (%s) setting SO_REUSEADDR {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    if (-1 == bind (endpoint->sockfd, addr, addrlen)) {
+        ERROR_LOG("errno %d (%s) binding the metrics socket to %s {%s}", errno, strerror(errno), address, __func__);
+        return -1;
+    }
+    if (AF_UNIX == addr->sa_family) {
+        endpoint->path = address;
+    }
+
+    if (-1 == listen (endpoint->sockfd, METRICS_BACKLOG)) {
+        ERROR_LOG("errno %d (%s) listening to the metrics socket {%s}", errno, strerror(errno), __func__);
+        return -1;
+    }
+
+    status = pthread_create (&endpoint->pthread, NULL, metrics_thread, (void *) endpoint);
+    if (0 != status) {
+        ERROR_LOG("creation of metrics thread code %d {%s}", status, __func__);
+        endpoint->pthread = 0;
+        return -1;
+    }
+
+    syslog (LOG_INFO, "Metrics served on %s", address);
+    return 0;
+}
+
+
+/**
+ * Answer a scrape: the request (if any comes quickly) is read and ignored, an HTTP GET gets an HTTP response,
+ * a bare connection (nc, socat) the dump alone
+ */
+static void metrics_serve (int clientfd)
+{
+    char request[METRICS_REQUESTLEN];
+    struct timeval timeout = { 0, 100000 };
+    ssize_t count;
+    FILE * out;
+
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    count = recv(clientfd, request, sizeof(request), 0);
+
+    out = fdopen(clientfd, "w");
+    if (NULL == out) {
+        ERROR_LOG("errno %d (%s) fdopen() {%s}", errno, strerror(errno), __func__);
+        close(clientfd);
+        return;
+    }
+
+    if ((4 <= count) && (0 == strncmp(request, "GET ", 4))) {
+        fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n");
+    }
+    metrics_dump (out);
+
+    fclose(out);
+}
+
+
+/**
+ * Metrics endpoint thread: serves the scrapes one at a time, the signals are left to the main thread
+ */
+void * metrics_thread (void * arg)
+{
+    metricsendpoint_t * endpoint = (metricsendpoint_t *) arg;
+    sigset_t sigset;
+    int clientfd;
+
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    while (!atomic_load(&endpoint->closing)) {
+        clientfd = accept(endpoint->sockfd, NULL, NULL);
+        if (-1 == clientfd) {
+            if (atomic_load(&endpoint->closing)) {
+                break;
+            }
+            if ((EINTR == errno) || (ECONNABORTED == errno)) {
+                continue;
+            }
+            ERROR_LOG("errno %d (%s) accepting a metrics scrape {%s}", errno, strerror(errno), __func__);
+            break;
+        }
+
+        metrics_serve (clientfd);
     }
 
-    syslog (LOG_DEBUG, "Closed connection from %s", hdl->clentaddr);
     return NULL;
 }
+
+
+/**
+ * Stop the metrics thread, shutting its socket down to make accept() return, and close the socket
+ */
+void stop_metrics (metricsendpoint_t * endpoint)
+{
+    atomic_store(&endpoint->closing, true);
+    if (-1 != endpoint->sockfd) {
+        shutdown(endpoint->sockfd, SHUT_RDWR);
+    }
+
+    if (0 != endpoint->pthread) {
+        DEBUG_LOG("JOINING metrics thread {%s}", __func__);
+        pthread_join(endpoint->pthread, NULL);
+        endpoint->pthread = 0;
+    }
+
+    if (-1 != endpoint->sockfd) {
+        close(endpoint->sockfd);
+        endpoint->sockfd = -1;
+    }
+
+    if (NULL != endpoint->path) {
+        unlink(endpoint->path);
+        endpoint->path = NULL;
+    }
+}
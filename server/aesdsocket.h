@@ -6,6 +6,8 @@
 #ifndef AESDSOCKET_H
 #define AESDSOCKET_H
 
+#define _GNU_SOURCE     // splice()
+
 #include <syslog.h>
 #include <stddef.h>
 #include <errno.h>
@@ -21,52 +23,507 @@
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <ctype.h>
+#ifdef USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #define SOCKPORT    "9000"
 #define BUFFLEN     1024
 #define BACKLOG     20
 
+#define EVENTLOOP_MAXEVENTS 64  // epoll events handled per epoll_wait() call
+#define REGISTRY_SLABLEN    32  // handlers allocated at once when the registry runs out of recycled ones
+#define REPLY_PIPELEN   (1024 * 1024)   // requested capacity of the pipe a connection splices the char device content into
+#define URING_DEPTH     64      // submission queue entries of a connection ring (io_uring engine)
+#define URING_MAXCHUNKS 16      // pipe sized chunks of a reply linked in a single submission
+#define WORKER_QUEUELEN     64  // accepted connections a worker deque can hold, the acceptor waits when every deque is full
+#define POOL_BUFFLEN    4096    // size of the pooled buffers, first size of every reception buffer
+#define POOL_BUFFERS    256     // buffers of the pool, more are taken from the heap and counted as misses
+#define POOL_NIL        UINT32_MAX  // index ending the pool free list
+#define WRITEV_MAXPACKETS   64  // packets of a batch written to the char device by a single writev() call
+#define METRICS_BACKLOG     4   // scrapes of the metrics endpoint waiting to be served
+#define METRICS_REQUESTLEN  1024    // bytes of a scrape request read (and ignored) before answering
+#define METRICS_FSYNCBUCKETS    20  // fdatasync() latency histogram, bucket i counts the calls under 2^i us (the last one everything else)
+
+// Durability policies of the tmp file (-s)
+#define SYNC_ALWAYS 0           // fdatasync() after every packet, before its reply
+#define SYNC_BATCH  1           // group commit: a flusher thread covers every pending packet with one fdatasync()
+#define SYNC_NONE   2           // left to the kernel
+#define SYNC_DELAY      10                  // default maximum latency (ms) added by the group commit
+#define SYNC_BATCHLEN   (1024 * 1024)       // pending bytes flushed without waiting for the latency to expire
+#define COMMIT_SPINS    64      // yields waiting for the previous records to be committed, before sleeping on the condition
+
+#define DRAIN_DEADLINE  2000    // default ms given to the connections to finish on SIGTERM (-g)
+
+// Per connection limits
+#define REPLY_HIGHWATER (4 * 1024 * 1024)   // default reply bytes queued before an event loop stops reading the connection (-q)
+#define REPLY_LOWWATER  (REPLY_HIGHWATER / 2)   // default reply bytes queued under which it reads again
+
 #define TIMEBUFFLEN 64
 #define TIMEBUFFFORMAT "timestamp:%a, %d %b %Y %T %z\n"
+#ifdef DO_TIMESTAMP
+#  define TIMESTAMP_INTERVAL 10 // default seconds between two timestamps (-t)
+#else
+#  define TIMESTAMP_INTERVAL 0  // no timestamp unless requested (-t)
+#endif
 
 
-#define USE_AESD_CHAR_DEVICE 1  //Remove comment on this line to enable char device driver log
+#ifndef USE_AESD_CHAR_DEVICE
+#  define USE_AESD_CHAR_DEVICE 1    //Build with -DUSE_AESD_CHAR_DEVICE=0 to log into the tmp file instead of the char device driver
+#endif
 
 #undef TMPFILE             // undef it, just in case
-#ifdef USE_AESD_CHAR_DEVICE
+#if USE_AESD_CHAR_DEVICE
 #  define TMPFILE     "/dev/aesdchar"
+#  ifdef USE_IO_URING
+#    error "USE_IO_URING needs USE_AESD_CHAR_DEVICE=0: the io_uring engine only drives the tmp file"
+#  endif
 #else
 #  define TMPFILE     "/var/tmp/aesdsocketdata"
 #endif
 
+// Named streams: a connection whose first packet is STREAM_CMD followed by a name appends to the stream storage,
+// TMPFILE suffixed by "." and the name (an empty name is the default stream). A char device stream is an instance
+// of the driver, loaded with "aesdchar_load streams=<name>,..." which creates /dev/aesdchar.<name>
+#define STREAM_CMD      "AESDSOCKET_STREAM:"
+#define STREAM_NAMELEN  32      // longest name + 1, made of letters, digits, '-' and '_'
+#define STREAMS_MAX     64      // streams open at once, default one included
+
+
+// Log levels (-l), a message is logged when its level is at most the current one
+#define LOGLEVEL_NONE   0
+#define LOGLEVEL_ERROR  1
+#define LOGLEVEL_DEBUG  2
+
+// Log sinks (-o)
+#define LOGSINK_STDOUT  0
+#define LOGSINK_SYSLOG  1
+#define LOGSINK_FILE    2
 
-//#define DEBUG_LOG(msg,...)
-#define DEBUG_LOG(msg,...) printf(msg "\n" , ##__VA_ARGS__)
+#define LOG_RINGLEN     256     // messages a thread ring holds (power of 2), the next ones are dropped until it's drained
+#define LOG_MSGLEN      248     // longer messages are truncated
+#define LOG_FLUSHDELAY  20      // ms between two drains of the rings
 
-//#define ERROR_LOG(msg,...)
-#define ERROR_LOG(msg,...) printf("ERROR: " msg "\n" , ##__VA_ARGS__)
+// A disabled level costs one predictable branch, an enabled one formats the message into the thread ring
+#define DEBUG_LOG(msg,...) do { \
+        if (__builtin_expect(LOGLEVEL_DEBUG <= atomic_load_explicit(&logger.level, memory_order_relaxed), 0)) { \
+            log_write (LOGLEVEL_DEBUG, msg , ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+#define ERROR_LOG(msg,...) do { \
+        if (__builtin_expect(LOGLEVEL_ERROR <= atomic_load_explicit(&logger.level, memory_order_relaxed), 1)) { \
+            log_write (LOGLEVEL_ERROR, "ERROR: " msg , ##__VA_ARGS__); \
+        } \
+    } while (0)
 
 #define END(state) success=state ; goto end
 
 
 bool signal_to_get_out = false;
+volatile sig_atomic_t signal_caught = 0;    //last SIGINT or SIGTERM received, logged out of the handler
+
+
+// A formatted message waiting in a ring
+struct logrecord {
+    int level;
+    char msg[LOG_MSGLEN];
+} typedef logrecord_t;
+
+// Messages of a thread: it's the only producer, the logger thread the only consumer (lock free).
+// Like the counter blocks, a ring outlives its thread and is handed over to the next thread created
+struct logring {
+    _Atomic unsigned int head;  //next message to drain, free running
+    _Atomic unsigned int tail;  //next free record, free running
+    _Atomic unsigned long dropped;  //messages lost because the ring was full
+    unsigned long reported;     //drops already reported by the logger thread
+    _Atomic bool inuse;         //owned by a running thread
+    struct logring * next;      //every ring allocated so far, never unlinked before exit
+    logrecord_t records[LOG_RINGLEN];
+} typedef logring_t;
+
+// Asynchronous logging: a thread drains every ring to the sink. Before it starts and once it's over, messages are written directly
+struct logger {
+    _Atomic int level;          //current level, checked by every message
+    int base;                   //-l none|error|debug, SIGUSR1 toggles between it and debug at run time
+    int sink;                   //-o stdout|syslog|path: LOGSINK_STDOUT, LOGSINK_SYSLOG or LOGSINK_FILE
+    const char * path;          //file of LOGSINK_FILE
+    FILE * file;                //open file of LOGSINK_FILE (NULL if non existant)
+    logring_t * _Atomic rings;
+    pthread_key_t key;          //releases the ring of an exiting thread
+    pthread_t pthread;          //should be initialized to 0 if non existant
+    pthread_t levelthread;      //takes SIGUSR1 with sigwait(), should be initialized to 0 if non existant
+    _Atomic bool running;       //the messages go through the rings
+    bool closing;               //the thread does a last drain and quits (protected by mutex)
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} typedef logger_t;
+
+logger_t logger = { .level = LOGLEVEL_ERROR, .base = LOGLEVEL_ERROR, .sink = LOGSINK_STDOUT, .path = NULL, .file = NULL, .rings = NULL,
+                    .pthread = 0, .levelthread = 0, .running = false, .closing = false,
+                    .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+__thread logring_t * threadring = NULL;
+
+
+// Run time configuration, filled from the command line options
+struct config {
+    bool daemon;                // -d: fork in the background once the socket is bound
+    unsigned int eventloops;    // -e N: number of epoll event loop threads (0 keeps one thread per connection)
+    bool cursor;                // -c: reply with the content the client hasn't received yet instead of the whole history
+    int syncpolicy;             // -s always|batch[:ms]|none: SYNC_ALWAYS, SYNC_BATCH or SYNC_NONE
+    unsigned int syncdelay;     // -s batch:ms: maximum latency of the group commit
+    bool persistent;            // -p: char device mode, one descriptor kept open per connection
+    unsigned int workers;       // -w N: pre-spawned worker threads serving the connections (0 creates one thread per connection)
+    unsigned int listeners;     // -r N: SO_REUSEPORT listening sockets, each with its own accept loop pinned to a core (0 keeps a single one)
+    const char * metrics;       // -m port|path: metrics endpoint on a loopback TCP port or a Unix socket path (NULL if non existant)
+    unsigned int timestamp;     // -t s: seconds between two timestamps appended to the storage (0 for none)
+    const char * timeformat;    // -f format: strftime() format of the timestamps
+    unsigned int drain;         // -g ms: deadline of the connections drain on exit (0 cancels them right away)
+    size_t maxpacket;           // -b bytes: longest packet accepted, the connection is closed beyond (0 for no limit)
+    size_t highwater;           // -q high[:low]: reply bytes queued by an event loop connection before it's not read anymore
+    size_t lowwater;            //  (0 for no limit), and under which it's read again
+    unsigned int rate;          // -k rate[:burst]: packets per second of a connection (0 for no limit)
+    unsigned int burst;         //  and packets allowed at once (the rate by default)
+} typedef config_t;
+
+config_t config = { false, 0, false, SYNC_ALWAYS, SYNC_DELAY, false, 0, 0, NULL, TIMESTAMP_INTERVAL, TIMEBUFFFORMAT, DRAIN_DEADLINE,
+                    0, REPLY_HIGHWATER, REPLY_LOWWATER, 0, 0 };
+
+
+// Global pool of fixed size buffers shared by every connection, lock free (Treiber stack)
+struct bufpool {
+    _Atomic uint64_t head;      //tag (high 32 bits, against ABA) and index (low 32 bits) of the first free buffer
+    _Atomic uint32_t * next;    //free list links, by buffer index
+    char * slab;                //POOL_BUFFERS buffers of POOL_BUFFLEN bytes (NULL if the allocation failed)
+    _Atomic unsigned long hits; //buffers served by the pool
+    _Atomic unsigned long misses;   //buffers taken from the heap because the pool was empty
+} typedef bufpool_t;
+
+bufpool_t bufpool;
+
+
+// Counters of the metrics endpoint, by index in metrics_t
+#define METRIC_ACCEPTED     0   // connections accepted
+#define METRIC_CLOSED       1   // connections closed
+#define METRIC_BATCHES      2   // batches of complete packets stored, one reply each
+#define METRIC_BYTESIN      3   // bytes received from the clients
+#define METRIC_BYTESOUT     4   // bytes sent back to the clients
+#define METRIC_REPLAYBYTES  5   // storage content read back for the replies
+#define METRIC_MUTEXWAIT    6   // ns waiting for the char device mutex
+#define METRIC_COMMITWAIT   7   // ns waiting for the records reserved before to be committed (tmp file)
+#define METRIC_REALLOCS     8   // reception and reply buffers grown
+#define METRIC_FSYNCS       9   // fdatasync() calls
+#define METRIC_FSYNCTIME    10  // ns spent in fdatasync()
+#define METRIC_OVERSIZED    11  // connections closed for a packet longer than the limit
+#define METRIC_PAUSES       12  // event loop connections not read anymore because of their queued replies
+#define METRIC_THROTTLES    13  // connections delayed by their rate limit
+#define METRIC_COUNTERS     14
+
+// Counters of a thread: only its thread writes them, the endpoint sums every block without any lock.
+// A block outlives its thread, it is handed over to the next thread created (the totals never go backwards)
+struct metrics {
+    _Atomic uint64_t counters[METRIC_COUNTERS];
+    _Atomic uint64_t fsynchist[METRICS_FSYNCBUCKETS];
+    _Atomic bool inuse;         //owned by a running thread
+    struct metrics * next;      //every block allocated so far, never unlinked before exit
+} typedef metrics_t;
+
+metrics_t * _Atomic metricslist = NULL;
+pthread_key_t metricskey;       //releases the block of an exiting thread
+__thread metrics_t * threadmetrics = NULL;
 
+// Add to a counter of the calling thread: a plain load and store, no locked instruction as the thread is the only writer
+#define METRIC_ADD(index, value) do { \
+        metrics_t * metricspt = (NULL != threadmetrics) ? threadmetrics : metrics_local (); \
+        atomic_store_explicit(&metricspt->counters[index], \
+            atomic_load_explicit(&metricspt->counters[index], memory_order_relaxed) + (value), memory_order_relaxed); \
+    } while (0)
+
+// Metrics endpoint: a thread answering each connection with a text dump of the summed counters
+struct metricsendpoint {
+    pthread_t pthread;          //should be initialized to 0 if non existant
+    int sockfd;                 //should be initialized to -1 if non existant
+    _Atomic bool closing;       //set before the socket is shut down to make accept() return
+    const char * path;          //Unix socket to unlink on exit (NULL for a TCP port)
+} typedef metricsendpoint_t;
+
+struct eventloop;
+
+
+// The storage of a stream, every client of the stream appends to it
+struct storage {
+    char name[STREAM_NAMELEN];  //stream name, empty for the default one
+    char path[sizeof(TMPFILE) + STREAM_NAMELEN];    //tmp file or char device
+    int fd;                     //tmp file descriptor (char device mode: only open while the mutex is held)
+    pthread_mutex_t mutex;      //char device mode: serializes the whole device write and read back sequence
+
+    // file mode: records are reserved lock free and become visible in reservation order
+    _Atomic off_t tail;         //end of the records reserved so far
+    _Atomic off_t committed;    //end of the records completely written, nothing before it will change anymore
+    _Atomic unsigned int commitwaiters; //writers sleeping on committedcond
+    _Atomic off_t holestart;    //records committed without being written lie in [holestart, holeend), never replayed
+    _Atomic off_t holeend;      //(holestart -1 if none, both set under syncmutex)
+
+    // file mode group commit (SYNC_BATCH)
+    _Atomic off_t durable;      //end of the records flushed to the disk
+    pthread_t flusher;          //should be initialized to 0 if non existant
+    pthread_mutex_t syncmutex;  //protects the conditions and the fields below
+    pthread_cond_t pendingcond; //records are waiting for the flusher
+    pthread_cond_t durablecond; //durable moved forward
+    pthread_cond_t committedcond;   //committed moved forward
+    bool closing;               //the flusher does a last flush and quits
+    struct eventloop * loops;   //event loops to wake up when durable moves forward
+    unsigned int loopcount;
+} typedef storage_t;
+
+// Streams open so far, created by the first connection selecting them and kept until the exit
+struct streams {
+    pthread_mutex_t mutex;      //protects the whole structure, only taken when a connection selects its stream
+    storage_t * table[STREAMS_MAX]; //the default stream first
+    unsigned int count;
+    struct eventloop * loops;   //event loops woken up by the group commit of every stream
+    unsigned int loopcount;
+} typedef streams_t;
+
+streams_t streams = { .mutex = PTHREAD_MUTEX_INITIALIZER, .count = 0, .loops = NULL, .loopcount = 0 };
+
+
+// A reply waiting to be sent back to a client
+struct reply {
+    struct reply * next;
+    size_t piped;               // snapshot bytes waiting in the connection pipe, sent before anything else
+    char * buffpt;              // snapshot of the content to send (NULL when replayed straight from the tmp file)
+    size_t buffsize;            // allocated length of buffpt, the buffer is kept when the reply is reused
+    off_t pos;                  // next byte to send (offset in the tmp file or in buffpt)
+    off_t end;                  // end of the reply (offset in the tmp file or length of buffpt)
+    off_t syncend;              // the reply is held until the tmp file is durable up to there (group commit in event loops)
+} typedef reply_t;
+
+struct handlers;
+
+// An epoll event loop thread multiplexing many client sockets
+struct eventloop {
+    pthread_t pthread;          //should be initialized to 0 if non existant
+    int epfd;                   //should be initialized to -1 if non existant
+    int notifyfd[2];            //pipe used by the acceptor to hand new connections over (a NULL handler wakes the loop up to quit)
+    int syncfd;                 //eventfd signaled by the flusher when the held replies may be sent
+    struct handlers * held;     //connections whose first reply waits for the group commit (linked through heldnext)
+    struct handlers * throttled;    //connections waiting for their rate limit (linked through throttlednext)
+} typedef eventloop_t;
+
+// A pre-spawned worker serving connections, one at a time, from its deque
+// The owner takes the oldest connection, idle workers steal the newest one from the others
+struct worker {
+    pthread_t pthread;          //should be initialized to 0 if non existant
+    pthread_mutex_t mutex;      //protects the deque
+    struct handlers * deque[WORKER_QUEUELEN];   //ring of accepted connections
+    unsigned int top;           //oldest connection (owner side), free running
+    unsigned int bottom;        //next free slot (steal side), free running
+    struct workpool * pool;
+    unsigned int id;
+} typedef worker_t;
+
+struct workpool {
+    worker_t * workers;
+    unsigned int count;         //workers started
+    _Atomic unsigned int next;  //next worker to push to
+    _Atomic unsigned int queued;    //connections waiting in the deques
+    pthread_mutex_t mutex;      //only used to sleep and wake up through the conditions
+    pthread_cond_t work;        //signaled when a connection is queued
+    pthread_cond_t space;       //signaled when a connection is dequeued
+} typedef workpool_t;
+
+#ifdef USE_IO_URING
+// Fixed files registered in a connection ring
+#define URING_CLIENT    0       // client socket
+#define URING_STORAGE   1       // tmp file
+#define URING_PIPEOUT   2       // read end of the reply pipe
+#define URING_PIPEIN    3       // write end of the reply pipe
+
+// io_uring instance of a connection, driven through the raw system calls
+struct uring {
+    int fd;                     //should be initialized to -1 if non existant
+    void * sqring;              //submission ring mapping (MAP_FAILED if non existant)
+    size_t sqringsize;
+    void * cqring;              //completion ring mapping, the same as sqring with IORING_FEAT_SINGLE_MMAP
+    size_t cqringsize;
+    struct io_uring_sqe * sqes; //submission entries mapping (MAP_FAILED if non existant)
+    size_t sqessize;
+    unsigned int * sqhead;
+    unsigned int * sqtail;
+    unsigned int sqmask;
+    unsigned int * sqarray;
+    unsigned int * cqhead;
+    unsigned int * cqtail;
+    unsigned int cqmask;
+    struct io_uring_cqe * cqes;
+    unsigned int queued;        //entries prepared since the last submission, their user_data is their rank
+    char * fixedbuffer;         //the reception buffer registered as buffer 0 (NULL if none)
+    size_t pipelen;             //capacity of the reply pipe, the size of the chunks
+} typedef uring_t;
+#endif
+
+// A slab of handlers, never freed before exit
+struct slab {
+    struct slab * next;
+    struct handlers * hdl;
+} typedef slab_t;
+
+// Connection registry: handlers are recycled through a free list and the live ones stay reachable for the shutdown
+struct registry {
+    pthread_mutex_t mutex;      //protects everything below
+    slab_t * slabs;             //every slab allocated so far
+    struct handlers * freelist; //recycled handlers (singly linked through next)
+    struct handlers * live;     //handlers in use (doubly linked through next/prev)
+    struct handlers * zombies;  //finished threads waiting to be joined (singly linked through next)
+    unsigned int livecount;
+    bool closing;               //the live list is owned by the shutdown, handlers are not retired anymore
+    bool draining;              //the shutdown waits for the live connections to close
+    pthread_cond_t drained;     //signaled when a connection closes while draining
+} typedef registry_t;
+
+// A listening socket and its accept loop: the first one runs in the main thread, the others in their own
+// With SO_REUSEPORT the kernel balances the incoming connections between them
+struct listener {
+    pthread_t pthread;          //0 for the main thread one or if non existant
+    int sockfd;                 //should be initialized to -1 if non existant
+    int timerfd;                //timestamp timer polled with the socket (-1 if non existant, only the first listener has one)
+    unsigned int id;            //core the accept loop is pinned to (modulo the online cores)
+    _Atomic bool closing;       //set before the socket is shut down to make accept() return
+    registry_t registry;        //its own connection set, the handlers are acquired from it: only this accept loop
+                                //and its connections take the mutex
+    storage_t * storage;
+    eventloop_t * loops;        //event loops the connections are handed over to (NULL if non existant)
+    unsigned int loopcount;
+    workpool_t * pool;          //worker pool the connections are queued to (NULL if non existant)
+} typedef listener_t;
 
 struct handlers {
-    pthread_mutex_t * pmutex;   //shared by every thread (NULL if non existant)
-    int * ptmpfd;               //shared as well (NULL if non existant)
+    storage_t * storage;        //stream storage, shared by its connections (NULL if non existant)
+    bool selected;              //the first packet has been checked for a stream selection
 
     pthread_t pthread;          //should be initialized to 0 if non existant
     char * buffpt;              //should be initialized to NULL if non existant
     int clientfd;               //should be initialized to -1 if non existant
+    off_t cursor;               //end of the content already sent to the client (cursor mode)
+    int pipefd[2];              //pipe holding the char device content spliced for the replies (-1 if non existant)
+    int devfd;                  //char device descriptor kept open in persistent mode (-1 if non existant)
+
+    char clentaddr[INET_ADDRSTRLEN];    //client address for the logs
+
+    size_t buffsize;            //allocated length of buffpt (0 if not a reception buffer)
+    size_t bufflen;             //received bytes stored in buffpt
+    size_t scanned;             //bytes of buffpt already searched for a '\n'
 
-    char * clentaddr;           //return of inet_ntoa (no need to be freed !don't know why!)
+    // event loop mode only
+    bool eof;                   //the client shut its side down, close once the replies are sent
+    uint32_t events;            //epoll events currently registered
+    reply_t * replyhead;        //replies waiting for the socket to be writable
+    reply_t * replytail;
+    reply_t * replyfree;        //sent replies kept with their buffer for the next packets (linked through next),
+                                //the threaded modes keep their single reply there as well
+    eventloop_t * loop;         //owning event loop
+    bool held;                  //in the loop held list
+    struct handlers * heldnext;
+    size_t queued;              //reply bytes waiting to be sent
+    bool paused;                //not read anymore until the queued replies fall under the low watermark
+    bool throttled;             //in the loop throttled list, not read anymore until resume
+    struct handlers * throttlednext;
+    uint64_t resume;            //monotonic ns the throttled connection is read again
+
+    // rate limit (token bucket, -k)
+    double tokens;              //packets the connection may send right now, negative when in debt
+    uint64_t refilled;          //monotonic ns of the last refill
+
+    registry_t * registry;      //registry the handler has been acquired from
+    struct handlers * next;     //links in the registry lists
+    struct handlers * prev;
 } typedef handlers_t;
 
 static void signal_handler ( int signal_number );
-void * timestamp_thread (void * handler);
-void initialize_handler (handlers_t * hdl_table, unsigned int threadnumber, pthread_mutex_t * pmutex, int * ptmpfd);
-void clean_handlers (handlers_t * hdl_table, unsigned int threadcount);
+void log_write (int level, const char * format, ...) __attribute__ ((format (printf, 2, 3)));
+int start_logger (void);
+void * loglevel_thread (void * arg);
+void * logger_thread (void * arg);
+void stop_logger (void);
+void initialize_handler (handlers_t * hdl, storage_t * storage);
+void release_handler (handlers_t * hdl);
+void clean_handlers (registry_t * registry);
+void registry_init (registry_t * registry);
+handlers_t * registry_acquire (registry_t * registry, storage_t * storage);
+void registry_release (registry_t * registry, handlers_t * hdl);
+void registry_retire (registry_t * registry, handlers_t * hdl);
+void registry_reap (registry_t * registry);
+void registry_drain_start (registry_t * registry);
+unsigned int registry_drain_wait (registry_t * registry, const struct timespec * timeout);
+void registry_destroy (registry_t * registry);
+void bufpool_init (bufpool_t * pool);
+char * bufpool_get (bufpool_t * pool);
+bool bufpool_owns (bufpool_t * pool, const char * buffpt);
+void bufpool_put (bufpool_t * pool, char * buffpt);
+int bufpool_grow (bufpool_t * pool, char ** buffpt, size_t * buffsize, size_t len);
+void bufpool_destroy (bufpool_t * pool);
+void metrics_init (void);
+metrics_t * metrics_local (void);
+uint64_t metrics_clock (void);
+int metrics_fdatasync (int fd);
+void metrics_dump (FILE * out);
+int start_metrics (metricsendpoint_t * endpoint, const char * address);
+void * metrics_thread (void * endpoint);
+void stop_metrics (metricsendpoint_t * endpoint);
+void metrics_destroy (void);
+int rxbuffer_reserve (handlers_t * hdl);
+uint64_t ratelimit_charge (handlers_t * hdl, const char * batch, size_t len);
+int rxbuffer_batch (handlers_t * hdl, size_t * towrite);
+void rxbuffer_consume (handlers_t * hdl, size_t consumed);
+void serve_connection (handlers_t * hdl);
 void *  server_client_app (void * handler);
+int storage_open (storage_t * storage);
+off_t storage_reserve (storage_t * storage, size_t len, int * cancelstate);
+void storage_commit (storage_t * storage, off_t start, size_t len, int cancelstate);
+void storage_hole (storage_t * storage, off_t start, size_t len);
+bool storage_covers_hole (storage_t * storage, off_t pos, off_t end);
+int storage_append (storage_t * storage, const char * record, size_t len, off_t * end);
+void storage_wait_durable (storage_t * storage, off_t end);
+void storage_notify_loops (storage_t * storage, struct eventloop * loops, unsigned int loopcount);
+void storage_close (storage_t * storage);
+void * flusher_thread (void * storage);
+void streams_init (storage_t * storage);
+storage_t * streams_get (const char * name, size_t len);
+void streams_notify_loops (struct eventloop * loops, unsigned int loopcount);
+void streams_close (void);
+int stream_select (handlers_t * hdl, size_t * towrite);
+int process_batch (handlers_t * hdl, const char * batch, size_t len, reply_t * reply);
+int timestamp_open (void);
+int timestamp_append (storage_t * storage, int timerfd);
+int send_reply (handlers_t * hdl, reply_t * reply);
+#ifdef USE_IO_URING
+int uring_serve_connection (handlers_t * hdl);
+#endif
+void * eventloop_thread (void * eventloop);
+int start_eventloop (eventloop_t * loop);
+int handover_connection (eventloop_t * loop, handlers_t * hdl);
+void stop_eventloops (eventloop_t * loops, unsigned int loopcount);
+void * worker_thread (void * worker);
+int start_workers (workpool_t * pool, unsigned int count);
+int dispatch_connection (workpool_t * pool, handlers_t * hdl);
+void stop_workers (workpool_t * pool);
+int open_listener (struct addrinfo * servinfo);
+int accept_connections (listener_t * listener);
+void * acceptor_thread (void * listener);
+void stop_listeners (listener_t * listeners, unsigned int listenercount);
 
 #endif
@@ -0,0 +1,45 @@
+#!/bin/sh
+# Tester script for the cursor mode of aesdsocket (-c): a reply only holds the content the client didn't get yet,
+# a new connection starts from the beginning of the content
+# Usage: sockettest-cursor.sh [server binary, file storage build]
+
+set -u
+
+target=localhost
+port=9000
+server=${1:-$(dirname $0)/../../server/aesdsocket-file}
+datafile=/var/tmp/aesdsocketdata
+expected=$(mktemp)
+received=$(mktemp)
+
+rm -f ${datafile}
+${server} -c &
+serverpid=$!
+sleep 1
+
+# two packets on the same connection: the second reply doesn't repeat the first packet
+printf 'one\ntwo\n' > ${expected}
+( printf 'one\n'; sleep 1; printf 'two\n' ) | nc ${target} ${port} -w 1 > ${received}
+cmp -s ${expected} ${received}
+rc=$?
+if [ $rc -eq 0 ]; then
+	# a new connection gets the whole content first
+	printf 'one\ntwo\nthree\n' > ${expected}
+	printf 'three\n' | nc ${target} ${port} -w 1 > ${received}
+	cmp -s ${expected} ${received}
+	rc=$?
+fi
+
+kill -TERM ${serverpid}
+wait ${serverpid}
+
+if [ $rc -eq 0 ]; then
+	echo "success"
+else
+	echo "failed: expected"
+	cat ${expected}
+	echo "but instead found"
+	cat ${received}
+fi
+rm -f ${expected} ${received}
+exit $rc
@@ -0,0 +1,61 @@
+#!/bin/sh
+# Tester script for the packet size limit of aesdsocket (-b): a connection sending a packet longer than the limit
+# ('\n' included) is closed without storing nor answering anything, the server keeps serving the others
+# Usage: sockettest-maxpacket.sh [server binary]
+
+set -u
+
+target=localhost
+port=9000
+server=${1:-$(dirname $0)/../../server/aesdsocket-file}
+maxpacket=100
+expected=$(mktemp)
+received=$(mktemp)
+
+# a packet of <length> bytes, '\n' included
+packet()
+{
+	head -c $(($1 - 1)) /dev/zero | tr '\0' "$2"
+	echo
+}
+
+rm -f /var/tmp/aesdsocketdata
+${server} -b ${maxpacket} &
+serverpid=$!
+sleep 1
+
+# longest packet accepted
+packet ${maxpacket} a > ${expected}
+packet ${maxpacket} a | nc ${target} ${port} -w 1 > ${received}
+cmp -s ${expected} ${received}
+rc=$?
+
+# too long, alone or after a packet within the limit in the same batch: nothing is stored
+if [ $rc -eq 0 ]; then
+	packet 3000 b | nc ${target} ${port} -w 1 > ${received}
+	( packet 10 c; packet $((maxpacket + 1)) d ) | nc ${target} ${port} -w 1 >> ${received}
+	test ! -s ${received}
+	rc=$?
+fi
+
+# the server is still up, with the accepted packet only
+if [ $rc -eq 0 ]; then
+	packet 20 e >> ${expected}
+	packet 20 e | nc ${target} ${port} -w 1 > ${received}
+	cmp -s ${expected} ${received}
+	rc=$?
+fi
+
+kill -TERM ${serverpid}
+wait ${serverpid}
+
+if [ $rc -eq 0 ]; then
+	echo "success"
+else
+	echo "failed: expected"
+	cat ${expected}
+	echo "but instead found"
+	cat ${received}
+fi
+rm -f ${expected} ${received}
+exit $rc
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Tester script for the named streams of aesdsocket: a connection whose first packet is "AESDSOCKET_STREAM:<name>"
+# appends to its own stream, the other connections keep the default one
+# Usage: sockettest-streams.sh [server binary, file storage build]
+
+set -u
+
+target=localhost
+port=9000
+server=${1:-$(dirname $0)/../../server/aesdsocket-file}
+datafile=/var/tmp/aesdsocketdata
+expected=$(mktemp)
+received=$(mktemp)
+
+# check <expected reply> <packets sent on one connection>
+check()
+{
+	printf "$1" > ${expected}
+	printf "$2" | nc ${target} ${port} -w 1 > ${received}
+	cmp -s ${expected} ${received}
+}
+
+rm -f ${datafile} ${datafile}.alpha
+${server} &
+serverpid=$!
+sleep 1
+
+# the selection packet is neither stored nor answered, each stream only replays its own packets
+check 'alpha one\n' 'AESDSOCKET_STREAM:alpha\nalpha one\n' \
+	&& check 'default one\n' 'default one\n' \
+	&& check 'alpha one\nalpha two\n' 'AESDSOCKET_STREAM:alpha\nalpha two\n' \
+	&& check 'default one\ndefault two\n' 'default two\n' \
+	&& check '' 'AESDSOCKET_STREAM:bad/name\nnever stored\n' \
+	&& check 'default one\ndefault two\ndefault three\n' 'default three\n'
+rc=$?
+
+kill -TERM ${serverpid}
+wait ${serverpid}
+
+if [ $rc -eq 0 ]; then
+	echo "success"
+else
+	echo "failed: expected"
+	cat ${expected}
+	echo "but instead found"
+	cat ${received}
+fi
+rm -f ${expected} ${received} ${datafile}.alpha
+exit $rc
@@ -0,0 +1,168 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Rings set up with aesd_circular_buffer_init_ring(): a capacity other than the default one, and a byte budget.
+* The driver gives the ring length and both limits as module parameters (max_entries, max_bytes)
+*/
+
+static void add_string(struct aesd_circular_buffer *buffer, const char *string, const char *expected_erased)
+{
+    struct aesd_buffer_entry entry;
+    const char *erased;
+
+    entry.buffptr = string;
+    entry.size = strlen(string);
+    entry.offset = 0;
+    erased = aesd_circular_buffer_add_entry(buffer, &entry);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(expected_erased, erased, "wrong entry overwritten by aesd_circular_buffer_add_entry()");
+}
+
+static size_t count_slots_in_use(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+    unsigned int index;
+    size_t used = 0;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        if (NULL != entry->buffptr)
+            used++;
+    }
+    return used;
+}
+
+/**
+* A ring of 8 slots keeping 5 entries: the indexes wrap with the mask several times, the oldest entry is overwritten
+* from the sixth write on and the content stays the 5 newest writes in order
+*/
+void test_circular_buffer_wraparound_custom_capacity()
+{
+    static const char *writes[] = { "w0\n", "w1 \n", "w2  \n", "w3\n", "w4 \n", "w5  \n", "w6\n", "w7 \n", "w8  \n",
+                                    "w9\n", "w10 \n", "w11  \n", "w12\n", "w13 \n", "w14  \n", "w15\n", "w16 \n", "w17  \n" };
+    const unsigned int writecount = sizeof(writes) / sizeof(writes[0]);
+    struct aesd_buffer_entry ring[8];
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t offset_rtn;
+    size_t expected_size;
+    size_t position;
+
+    memset(ring, 0, sizeof(ring));
+    aesd_circular_buffer_init_ring(&buffer, ring, 8, 5, 0);
+
+    for (unsigned int i = 0; i < writecount; i++) {
+        add_string(&buffer, writes[i], (i < 5) ? NULL : writes[i - 5]);
+        TEST_ASSERT_EQUAL_UINT_MESSAGE((i < 5) ? i + 1 : 5, buffer.count, "entries kept beyond max_entries");
+        TEST_ASSERT_TRUE_MESSAGE(buffer.in_offs <= buffer.mask, "in_offs out of the ring");
+        TEST_ASSERT_TRUE_MESSAGE(buffer.out_offs <= buffer.mask, "out_offs out of the ring");
+    }
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "5 entries out of 5 must be full");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(5, count_slots_in_use(&buffer), "the overwritten slots must be cleared");
+
+    expected_size = 0;
+    for (unsigned int i = writecount - 5; i < writecount; i++)
+        expected_size += strlen(writes[i]);
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(expected_size, aesd_circular_buffer_size(&buffer), "total size of the 5 newest writes");
+
+    // the concatenated content is the 5 newest writes, from the oldest one
+    position = 0;
+    for (unsigned int i = writecount - 5; i < writecount; i++) {
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, position, &offset_rtn);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "no entry found inside the content");
+        TEST_ASSERT_EQUAL_STRING_MESSAGE(writes[i], entry->buffptr, "entries not in write order after the wraparound");
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(0, offset_rtn, "an entry starts at its first byte");
+        position += strlen(writes[i]);
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, position, &offset_rtn),
+                             "nothing past the end of the content");
+}
+
+/**
+* A byte budget of 10 bytes: the oldest entries are evicted one by one while the content is over budget, but the
+* newest entry is kept even alone over the budget
+*/
+void test_circular_buffer_byte_budget_eviction()
+{
+    struct aesd_buffer_entry ring[8];
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t offset_rtn;
+    static const char *first = "aaaa";
+    static const char *second = "bbbb";
+    static const char *third = "ccc";
+    static const char *large = "a write longer than the budget\n";
+
+    memset(ring, 0, sizeof(ring));
+    aesd_circular_buffer_init_ring(&buffer, ring, 8, 8, 10);
+
+    add_string(&buffer, first, NULL);
+    add_string(&buffer, second, NULL);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_evict(&buffer), "8 bytes out of 10 is within the budget");
+
+    add_string(&buffer, third, NULL);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(first, aesd_circular_buffer_evict(&buffer), "11 bytes: the oldest entry goes");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_evict(&buffer), "7 bytes out of 10 is within the budget");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(7, aesd_circular_buffer_size(&buffer), "size after the eviction");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(2, buffer.count, "entries after the eviction");
+
+    // positions are counted from the oldest entry left
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &offset_rtn);
+    TEST_ASSERT_NOT_NULL_MESSAGE(entry, "no entry at the beginning of the content");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(second, entry->buffptr, "the content must begin with the oldest entry left");
+
+    add_string(&buffer, large, NULL);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(second, aesd_circular_buffer_evict(&buffer), "over budget: the oldest entry goes");
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(third, aesd_circular_buffer_evict(&buffer), "still over budget: the next one goes");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_evict(&buffer), "the newest entry is kept even over the budget");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(1, buffer.count, "only the newest entry is left");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(strlen(large), aesd_circular_buffer_size(&buffer), "size of the newest entry alone");
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(1, count_slots_in_use(&buffer), "the evicted slots must be cleared");
+}
+
+/**
+* The binary search over the entry offsets, at every entry boundary: the first and the last byte of each entry, once
+* the oldest entries are gone (the offsets don't start from 0 anymore) and the ring wrapped around
+*/
+void test_circular_buffer_find_entry_boundaries()
+{
+    static const char *writes[] = { "gone\n", "gone too\n", "x\n", "three\n", "y", "a longer one\n", "z\n", "last\n" };
+    const unsigned int writecount = sizeof(writes) / sizeof(writes[0]);
+    struct aesd_buffer_entry ring[4];
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    size_t offset_rtn;
+    size_t start;
+    size_t size;
+
+    memset(ring, 0, sizeof(ring));
+    aesd_circular_buffer_init_ring(&buffer, ring, 4, 4, 0);
+
+    for (unsigned int i = 0; i < writecount; i++)
+        add_string(&buffer, writes[i], (i < 4) ? NULL : writes[i - 4]);
+
+    start = 0;
+    for (unsigned int i = writecount - 4; i < writecount; i++) {
+        size = strlen(writes[i]);
+
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, start, &offset_rtn);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "no entry at its first byte");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[i], entry->buffptr, "wrong entry at its first byte");
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(0, offset_rtn, "wrong offset at the first byte of an entry");
+
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, start + size - 1, &offset_rtn);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "no entry at its last byte");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[i], entry->buffptr, "wrong entry at its last byte");
+        TEST_ASSERT_EQUAL_UINT_MESSAGE(size - 1, offset_rtn, "wrong offset at the last byte of an entry");
+
+        start += size;
+    }
+
+    TEST_ASSERT_EQUAL_UINT_MESSAGE(start, aesd_circular_buffer_size(&buffer), "size of the 4 newest writes");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, start, &offset_rtn),
+                             "nothing at the end of the content");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, start + 100, &offset_rtn),
+                             "nothing past the end of the content");
+}